@@ -19,6 +19,7 @@
 #   endif
 #endif
 
+#include <stddef.h>
 #include <Availability.h>
 #include <TargetConditionals.h>
 
@@ -57,6 +58,150 @@ BLOCK_EXPORT void _Block_object_assign(void *, const void *, const int)
 BLOCK_EXPORT void _Block_object_dispose(const void *, const int)
     __OSX_AVAILABLE_STARTING(__MAC_10_6, __IPHONE_3_2);
 
+// Scoped arenas for heap copies.
+// While an arena pushed by this thread is the innermost one, Block_copy of a
+// stack block and promotion of its __block variables allocate from the arena.
+// Block_release still runs dispose helpers, but the memory is reclaimed in
+// one step by Block_arena_pop. Copies still referenced when the arena is
+// popped keep their memory until their last Block_release; the return value
+// of Block_arena_pop is the number of such escaped copies.
+// Arenas must be popped in reverse order of pushing, on the pushing thread.
+typedef struct Block_arena *Block_arena_t;
+
+BLOCK_EXPORT Block_arena_t Block_arena_push(void);
+
+BLOCK_EXPORT size_t Block_arena_pop(Block_arena_t arena);
+
+// Deferred release.
+// Block_release_deferred gives up a reference like Block_release, but the
+// refcount update happens at the calling thread's next Block_drain_deferred,
+// when it has deferred releases of too many distinct blocks, or when it
+// exits. Deferred releases of the same block are coalesced, and the dispose
+// helpers of blocks that die in one drain run together before any of them
+// is freed. The caller must not use its reference after deferring it.
+BLOCK_EXPORT void Block_release_deferred(const void *aBlock);
+
+BLOCK_EXPORT void Block_drain_deferred(void);
+
+// Pinned heap blocks.
+// Block_pin makes a heap block immortal and takes over the caller's
+// reference to it. While it is pinned, Block_copy and Block_release of the
+// block are free of writes and are not counted. Block_unpin ends the pin
+// and releases the reference it held. Every reference obtained while the
+// block was pinned must be released before Block_unpin, and references
+// held from before Block_pin must not be released until after it: a copy
+// and its release on opposite sides of either call is undefined. A block
+// must not be pinned twice. Both ignore global and stack blocks.
+BLOCK_EXPORT void Block_pin(const void *aBlock);
+
+BLOCK_EXPORT void Block_unpin(const void *aBlock);
+
+// Sharded heap blocks.
+// Block_shard spreads the refcount of a heap block shared by many threads
+// over per-CPU counters, so that Block_copy and Block_release on different
+// CPUs do not contend. It takes over the caller's reference, so the block
+// stays alive until Block_unshard, which folds the counters back and
+// releases that reference; after that the block is freed by its last
+// Block_release as usual. Unlike Block_unpin, Block_unshard may run while
+// other threads are copying and releasing the block. Block_shard leaves
+// global, stack, pinned and biased blocks as they are, in which case
+// Block_unshard is a plain Block_release.
+BLOCK_EXPORT void Block_shard(const void *aBlock);
+
+BLOCK_EXPORT void Block_unshard(const void *aBlock);
+
+// Counted and bulk copy and release.
+// Block_retain_n is n calls of Block_copy and Block_release_n is n calls of
+// Block_release, each made with one refcount update where possible.
+// Block_copy_array and Block_release_array copy or release `count`
+// distinct blocks, prefetching ahead and running the dispose helpers of
+// the blocks that die in batches before freeing them.
+BLOCK_EXPORT void *Block_retain_n(const void *aBlock, size_t n);
+
+BLOCK_EXPORT void Block_release_n(const void *aBlock, size_t n);
+
+BLOCK_EXPORT void Block_copy_array(void **copies, const void * const *blocks, size_t count);
+
+BLOCK_EXPORT void Block_release_array(const void * const *blocks, size_t count);
+
+// Copies into caller-provided storage.
+// Block_copy_into copies aBlock into the `capacity` bytes at `buffer`, which
+// must be pointer-aligned, promoting its captures as Block_copy would, and
+// returns the copy. If the block needs more than `capacity` bytes (see
+// Block_size) nothing is copied and NULL is returned. The copy is not
+// reference counted: Block_release ignores it and Block_copy of it makes a
+// heap copy, as for a stack block. Block_destroy_in_place releases its
+// captures; the storage then belongs to the caller again.
+BLOCK_EXPORT void *Block_copy_into(void *buffer, size_t capacity, const void *aBlock);
+
+BLOCK_EXPORT void Block_destroy_in_place(void *aBlock);
+
+// Interned copies.
+// Block_copy_interned copies aBlock like Block_copy, except that stack
+// blocks without copy helpers that have the same invoke function,
+// descriptor and captured bytes as an earlier interned copy share that
+// copy. Interned copies live until the process exits; Block_copy and
+// Block_release of them are allowed and do nothing. Once the intern table
+// is full, further blocks are copied normally.
+BLOCK_EXPORT void *Block_copy_interned(const void *aBlock);
+
+// Graph copies.
+// Block_copy_graph copies aBlock like Block_copy, together with the stack
+// blocks it captures, the stack blocks those capture, and so on, and the
+// __block variables any of them capture that are still on the stack. It
+// walks the captures iteratively and places all of the copies in a single
+// allocation, which is freed once every copy in it has been released.
+// Blocks whose captures the runtime cannot see from their layout are
+// copied with their own copy helpers; graphs too large for one allocation
+// are copied as by Block_copy.
+BLOCK_EXPORT void *Block_copy_graph(const void *aBlock);
+
+// Moving copies.
+// Block_copy_move copies aBlock like Block_copy, but when aBlock is a stack
+// block its copy helper may move captured C++ objects instead of copying
+// them. Use it when the stack block will not be used again, for example
+// just before it goes out of scope. Helpers that cannot move (including
+// every helper the compiler generates today) copy as usual.
+BLOCK_EXPORT void *Block_copy_move(const void *aBlock);
+
+// Trampolines.
+// Block_trampoline_create returns a C function pointer that calls aBlock
+// with the arguments it is called with. The block is copied and stays
+// alive until Block_trampoline_destroy. Up to five integer or pointer
+// arguments are supported on x86-64 and up to seven on arm64, plus any
+// floating-point arguments; arguments passed on the stack are not. Returns
+// NULL if aBlock cannot be copied, where executable memory cannot be
+// mapped, and on platforms other than ELF x86-64 and arm64.
+BLOCK_EXPORT void *Block_trampoline_create(const void *aBlock);
+
+BLOCK_EXPORT void Block_trampoline_destroy(void *trampoline);
+
+// Chunked application.
+// Block_apply_chunked calls aBlock, a void (^)(size_t start, size_t count),
+// over [0, count) in consecutive chunks of at most `chunk` elements, or of
+// a default size if `chunk` is 0. Block_chunked_adapter returns a new heap
+// block of that type which calls elementBlock, a void (^)(size_t index),
+// for each index of its chunk; release it with Block_release.
+BLOCK_EXPORT void Block_apply_chunked(size_t count, size_t chunk, const void *aBlock);
+
+BLOCK_EXPORT void *Block_chunked_adapter(const void *elementBlock);
+
+// Parallel application.
+// Block_parallel_apply calls aBlock, a void (^)(size_t index), once for
+// each index in [0, iterations) on a pool of threads with one per CPU, and
+// returns when all calls have returned. The caller's thread takes part.
+// The block is copied once and the copy is shared by every thread, so it
+// must be safe to call concurrently. Calls may nest.
+BLOCK_EXPORT void Block_parallel_apply(size_t iterations, const void *aBlock);
+
+// Block_parallel_sort sorts count elements of width bytes at base with a
+// stable merge sort on the same pool, ordering them by comparator, an
+// int (^)(const void *, const void *) with the meaning of qsort's. Returns
+// 0, or -1 with errno set if scratch space for count elements cannot be
+// allocated or the arguments are invalid, in which case base is untouched.
+BLOCK_EXPORT int Block_parallel_sort(void *base, size_t count, size_t width,
+                                     const void *comparator);
+
 // Used by the compiler. Do not use these variables yourself.
 // 由编译器使用，不要自己调用此函数。
 
@@ -212,6 +212,11 @@ typedef uintptr_t BlockByrefDestroyFunction;
 enum {
     BLOCK_DEALLOCATING =      (0x0001),  // runtime
     BLOCK_REFCOUNT_MASK =     (0xfffe),  // runtime // 用来标识栈 Block
+    BLOCK_IN_ARENA =          (1 << 16), // runtime: heap copy lives in a Block arena
+    BLOCK_COALLOCATED =       (1 << 17), // runtime: shares one allocation with its byrefs
+    BLOCK_REFCOUNT_OVERFLOW = (1 << 18), // runtime: part of the refcount is in a side table
+    BLOCK_BIASED =            (1 << 19), // runtime: refcount is biased to the copying thread
+    BLOCK_PINNED =            (1 << 20), // runtime: immortal until Block_unpin
     
     BLOCK_NEEDS_FREE =        (1 << 24), // runtime // 用来标识堆 Block
     
@@ -307,6 +312,9 @@ enum {
     BLOCK_BYREF_HAS_COPY_DISPOSE =  (  1 << 25), // compiler // 表示 byref 含有 copy dispose 函数，
     // 在 __block 捕获的变量为对象类型时就会生成 copy dispose 函数来管理对象内存
     BLOCK_BYREF_NEEDS_FREE =        (  1 << 24), // runtime // 判断是否需要释放
+    BLOCK_BYREF_IN_ARENA =          (  1 << 16), // runtime: heap copy lives in a Block arena
+    BLOCK_BYREF_COALLOCATED =       (  1 << 17), // runtime: shares one allocation with a block
+    BLOCK_BYREF_REFCOUNT_OVERFLOW = (  1 << 18), // runtime: same as BLOCK_REFCOUNT_OVERFLOW
 };
 
 // 结构体 Block_byref，变量在被 __block 修饰时由编译器来生成
@@ -486,6 +494,20 @@ BLOCK_EXPORT bool _Block_tryRetain(const void *aBlock)
 BLOCK_EXPORT bool _Block_isDeallocating(const void *aBlock)
     __OSX_AVAILABLE_STARTING(__MAC_10_7, __IPHONE_4_3);
 
+// Called by a copy helper with its source block. True if the block is
+// being promoted by Block_copy_move, so the helper may move captured
+// objects out of it instead of copying them.
+BLOCK_EXPORT bool _Block_copy_is_move(const void *src);
+
+// Calls aBlock with the arguments described by its signature, on x86-64 and
+// arm64. args[i] points at the value of the i-th argument after the block
+// itself and result receives the return value, if any. The signature is
+// compiled once per descriptor, so calls do not parse it or allocate.
+// Returns false without calling the block if there is no signature, or if
+// it passes structs or long doubles, returns a small struct, or needs more
+// argument stack than the runtime provides.
+BLOCK_EXPORT bool _Block_invoke_dynamic(const void *aBlock, void *result, void * const *args);
+
 
 // the raw data space for runtime classes for blocks
 // class+meta used for stack, malloc, and collectable based blocks
@@ -512,4 +534,32 @@ typedef struct Block_callbacks_RR Block_callbacks_RR;
 
 BLOCK_EXPORT void _Block_use_RR2(const Block_callbacks_RR *callbacks);
 
+// Storage for heap copies of blocks and __block variables.
+// free_sized, when set, is called instead of free and is passed the size
+// that was given to alloc.
+struct Block_callbacks_alloc {
+    size_t  size; // size == sizeof(struct Block_callbacks_alloc)
+    void *(*alloc)(size_t size);
+    void  (*free)(void *ptr);
+    void  (*free_sized)(void *ptr, size_t size);
+};
+
+typedef struct Block_callbacks_alloc Block_callbacks_alloc;
+
+// Must be called before the first block or __block variable is copied
+// to the heap. Scoped arenas still take precedence while one is active.
+BLOCK_EXPORT void _Block_use_alloc(const Block_callbacks_alloc *callbacks);
+
+// Per-descriptor counts of heap copies made from stack blocks and of heap
+// copies disposed. Collected only when LIBCLOSURE_BLOCK_STATS=YES is set.
+struct Block_statistics {
+    uint64_t copies;
+    uint64_t disposes;
+};
+
+typedef struct Block_statistics Block_statistics;
+
+// Returns false if nothing is known about aBlock's descriptor.
+BLOCK_EXPORT bool _Block_statistics(const void *aBlock, Block_statistics *stats);
+
 #endif
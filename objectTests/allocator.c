@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// _Block_use_alloc routes heap copies of blocks and __block variables
+// through the registered allocator, and frees them with their size.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+int main() {
+    testuse_counting_alloc();
+
+    __block int counter = 0;
+    int step = 2;
+    void (^b)(void) = Block_copy(^{ counter += step; });
+    // The block and counter share one allocation when the compiler
+    // emitted an extended layout for the block.
+    int coallocated = (((struct Block_layout *)(void *)b)->flags & BLOCK_COALLOCATED) != 0;
+    int expected = coallocated ? 1 : 2;
+    testassert(testallocs == expected);
+
+    void (^again)(void) = Block_copy(b);
+    testassert(again == b);
+    testassert(testallocs == expected);
+
+    b();
+    Block_release(again);
+    Block_release(b);
+    testassert(counter == 2);
+    testassert(testfrees == expected - 1);   // the stack frame still holds counter
+
+    void (^pod)(void) = Block_copy(^{ (void)step; });
+    Block_release(pod);
+    testassert(testallocs == expected + 1);
+    testassert(testfrees == expected);
+
+    succeed(__FILE__);
+}
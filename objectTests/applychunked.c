@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_apply_chunked covers the whole range in chunks of the requested
+// size, and Block_chunked_adapter runs an element-wise block under it.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <Block.h>
+#include "test.h"
+
+int main() {
+    enum { COUNT = 10000 };
+    static double values[COUNT];
+    for (int i = 0; i < COUNT; i++) values[i] = i;
+
+    __block double sum = 0;
+    __block int chunks = 0;
+    Block_apply_chunked(COUNT, 256, ^(size_t start, size_t count) {
+        double partial = 0;
+        for (size_t i = start; i < start + count; i++) partial += values[i];
+        sum += partial;
+        chunks++;
+    });
+    testassert(sum == (double)COUNT * (COUNT - 1) / 2);
+    testassert(chunks == (COUNT + 255) / 256);
+
+    __block int calls = 0;
+    __block size_t last = 0;
+    void (^perElement)(size_t) = ^(size_t i) {
+        testassert(i == 0 || i == last + 1);
+        last = i;
+        calls++;
+    };
+    void (^chunked)(size_t, size_t) = Block_chunked_adapter(perElement);
+    Block_apply_chunked(COUNT, 0, chunked);
+    Block_release(chunked);
+    testassert(calls == COUNT);
+    testassert(last == COUNT - 1);
+
+    // Chunks that do not divide a huge range must not wrap around.
+    __block int huge = 0;
+    __block size_t end = 0;
+    Block_apply_chunked(SIZE_MAX - 1, SIZE_MAX / 2 + 1, ^(size_t start, size_t count) {
+        huge++;
+        end = start + count;
+    });
+    testassert(huge == 2);
+    testassert(end == SIZE_MAX - 1);
+
+    Block_apply_chunked(0, 16, ^(size_t start, size_t count) {
+        (void)start; (void)count;
+        fail("called for an empty range");
+    });
+
+    succeed(__FILE__);
+}
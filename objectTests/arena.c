@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_arena_push/pop: copies made inside an arena are reclaimed in bulk,
+// dispose helpers still run, and copies that outlive the arena survive.
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+typedef void (^voidVoid)(void);
+
+int main() {
+    voidVoid escaped;
+    {
+        Block_arena_t arena = Block_arena_push();
+
+        __block int counter = 0;
+        for (int i = 0; i < 1000; i++) {
+            int value = i;
+            voidVoid inner = ^{ counter += value; };
+            voidVoid b = Block_copy(^{ inner(); });
+            testassert(((struct Block_layout *)b)->flags & BLOCK_IN_ARENA);
+            b();
+            Block_release(b);
+        }
+        testassert(counter == 999 * 1000 / 2);
+
+        int seven = 7;
+        escaped = Block_copy(^{ counter = seven; });
+
+        // escaped, plus the __block counter it shares with this frame
+        size_t leaked = Block_arena_pop(arena);
+        testassert(leaked == 2);
+    }
+
+    escaped();
+    Block_release(escaped);
+
+    // Outside the arena copies are ordinary heap copies again.
+    int x = 1;
+    voidVoid plain = Block_copy(^{ (void)x; });
+    testassert(!(((struct Block_layout *)plain)->flags & BLOCK_IN_ARENA));
+    Block_release(plain);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+// TEST_ENV LIBCLOSURE_BIASED_REFCOUNT=YES
+
+// Biased heap blocks are retained and released cheaply by the thread that
+// copied them, and still die exactly once when references are handed to
+// other threads, released there, or outlive the copying thread.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define THREADS 4
+#define ROUNDS 100000
+
+typedef int (^block_t)(void);
+
+static block_t make(int value) {
+    return Block_copy(^{ return value; });
+}
+
+static void *releaseOnce(void *arg) {
+    Block_release((block_t)arg);
+    return NULL;
+}
+
+static void *churn(void *arg) {
+    block_t b = (block_t)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        block_t again = Block_copy(b);
+        testassert(again() == 42);
+        Block_release(again);
+    }
+    return NULL;
+}
+
+static block_t orphan;
+
+static void *copyAndExit(void *arg __unused) {
+    orphan = make(7);
+    (void)Block_copy(orphan);
+    (void)Block_copy(orphan);
+    return NULL;
+}
+
+int main() {
+    testuse_counting_alloc();
+    pthread_t th[THREADS];
+
+    // Owner-only traffic.
+    block_t b = make(42);
+    testassert(((struct Block_layout *)(void *)b)->flags & BLOCK_BIASED);
+    for (int i = 0; i < ROUNDS; i++) {
+        (void)Block_copy(b);
+    }
+    for (int i = 0; i < ROUNDS; i++) {
+        Block_release(b);
+    }
+    testassert(testfrees == 0);
+    testassert(b() == 42);
+
+    // Shared with other threads.
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&th[i], NULL, churn, (void *)b);
+    }
+    churn((void *)b);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    testassert(testfrees == 0);
+
+    // Handed off: another thread releases the owner's references, the
+    // last one included. The owner merges at its next release.
+    (void)Block_copy(b);
+    pthread_create(&th[0], NULL, releaseOnce, (void *)b);
+    pthread_join(th[0], NULL);
+    pthread_create(&th[0], NULL, releaseOnce, (void *)b);
+    pthread_join(th[0], NULL);
+    testassert(testfrees == 0);
+    Block_release(make(1));
+    testassert(testfrees == 2);
+
+    // The copying thread exits while references are outstanding.
+    pthread_create(&th[0], NULL, copyAndExit, NULL);
+    pthread_join(th[0], NULL);
+    testassert(orphan() == 7);
+    Block_release(orphan);
+    Block_release(orphan);
+    testassert(testfrees == 2);
+    Block_release(orphan);
+    testassert(testfrees == 3);
+
+    succeed(__FILE__);
+}
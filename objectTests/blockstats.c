@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+// TEST_ENV LIBCLOSURE_BLOCK_STATS=YES
+
+// Copies and disposes are counted per descriptor, and the cached
+// signature and layout agree with the descriptor.
+
+#include <stdio.h>
+#include <string.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+static void (^make(int i))(void) {
+    return Block_copy(^{ (void)i; });
+}
+
+int main() {
+    __block int counter = 0;
+
+    for (int i = 0; i < 10; i++) {
+        void (^byref)(void) = Block_copy(^{ counter++; });
+        byref();
+        Block_release(byref);
+        Block_release(make(i));
+    }
+    testassert(counter == 10);
+
+    void (^probe)(void) = ^{ counter++; };
+    Block_statistics stats;
+    testassert(_Block_statistics(probe, &stats));
+    testassert(stats.copies == 0);
+
+    void (^pod)(void) = make(0);
+    testassert(_Block_statistics(pod, &stats));
+    testassert(stats.copies == 11);
+    testassert(stats.disposes == 10);
+    Block_release(pod);
+
+    testassert(_Block_signature(probe) != NULL);
+    testassert(0 == strcmp(_Block_signature(probe), "v8@?0"));
+    testassert(_Block_signature(probe) == _Block_signature(probe));
+
+    succeed(__FILE__);
+}
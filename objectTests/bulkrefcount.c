@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_retain_n and Block_release_n move the count by n, including past
+// the inline refcount limit; Block_copy_array and Block_release_array
+// behave like a loop of Block_copy and Block_release.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 300
+
+typedef int (^block_t)(void);
+
+static int refcount(block_t b) {
+    return (((struct Block_layout *)(void *)b)->flags & BLOCK_REFCOUNT_MASK) / 2;
+}
+
+int main() {
+    testuse_counting_alloc();
+
+    int value = 7;
+    block_t b = Block_retain_n(^{ return value; }, 5);
+    testassert(b() == 7);
+    testassert(refcount(b) == 5);
+
+    Block_retain_n(b, 100000);
+    Block_release_n(b, 100004);
+    testassert(refcount(b) == 1);
+    testassert(testfrees == 0);
+    Block_release_n(b, 1);
+    testassert(testfrees == 1);
+
+    static block_t blocks[COUNT];
+    static block_t copies[COUNT];
+    for (int i = 0; i < COUNT; i++) {
+        blocks[i] = Block_copy(^{ return i; });
+    }
+    Block_copy_array((void **)copies, (const void * const *)blocks, COUNT);
+    for (int i = 0; i < COUNT; i++) {
+        testassert(copies[i] == blocks[i]);
+        testassert(refcount(blocks[i]) == 2);
+    }
+    Block_release_array((const void * const *)copies, COUNT);
+    testassert(testfrees == 1);
+    Block_release_array((const void * const *)blocks, COUNT);
+    testassert(testfrees == 1 + COUNT);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// __block storage is recycled through per-thread magazines.
+// Promote and release __block variables of several sizes on many
+// threads, including threads that exit with full magazines.
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define THREADS 8
+#define ROUNDS 10000
+
+typedef struct { long words[6]; } Medium;
+typedef struct { long words[40]; } Large;
+
+static void *worker(void *arg __unused) {
+    for (int i = 0; i < ROUNDS; i++) {
+        __block int small = i;
+        __block Medium medium;
+        __block Large large;
+        medium.words[5] = i;
+        large.words[39] = i;
+
+        void (^b)(void) = Block_copy(^{
+            small++;
+            medium.words[5]++;
+            large.words[39]++;
+        });
+        b();
+        testassert(small == i + 1);
+        testassert(medium.words[5] == i + 1);
+        testassert(large.words[39] == i + 1);
+
+        // A second copy shares the promoted storage.
+        void (^b2)(void) = Block_copy(^{ small += 2; });
+        b2();
+        testassert(small == i + 3);
+
+        Block_release(b);
+        Block_release(b2);
+    }
+    return NULL;
+}
+
+int main() {
+    for (int round = 0; round < 4; round++) {
+        pthread_t threads[THREADS];
+        for (int i = 0; i < THREADS; i++) {
+            pthread_create(&threads[i], NULL, worker, NULL);
+        }
+        for (int i = 0; i < THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Copies of a stack block that captures nothing share one global
+// instance per invoke function and descriptor.
+
+#include <stdio.h>
+#include <string.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+static int Invoked = 0;
+
+static void invoke(void *block) {
+    (void)block;
+    Invoked++;
+}
+
+static struct Block_descriptor_1 descriptor = { 0, sizeof(struct Block_layout) };
+static struct Block_descriptor_1 other = { 0, sizeof(struct Block_layout) };
+
+static void makeStackBlock(struct Block_layout *block, struct Block_descriptor_1 *desc) {
+    memset(block, 0, sizeof(*block));
+    block->isa = _NSConcreteStackBlock;
+    block->invoke = (__typeof(block->invoke))invoke;
+    block->descriptor = desc;
+}
+
+int main() {
+    struct Block_layout first, second, third;
+    makeStackBlock(&first, &descriptor);
+    makeStackBlock(&second, &descriptor);
+    makeStackBlock(&third, &other);
+
+    void (^a)(void) = Block_copy((void (^)(void))(void *)&first);
+    void (^b)(void) = Block_copy((void (^)(void))(void *)&second);
+    void (^c)(void) = Block_copy((void (^)(void))(void *)&third);
+
+    testassert(a == b);
+    testassert(a != c);
+    testassert(((struct Block_layout *)a)->flags & BLOCK_IS_GLOBAL);
+    testassert(((struct Block_layout *)a)->isa == _NSConcreteGlobalBlock);
+
+    a();
+    c();
+    testassert(Invoked == 2);
+
+    // The shared instance is immortal.
+    for (int i = 0; i < 1000; i++) {
+        Block_release(Block_copy((void (^)(void))(void *)&first));
+        Block_release(a);
+    }
+    a();
+    testassert(Invoked == 3);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// The first copy of a block shares one allocation with the __block
+// variables it promotes. Later copies of other blocks reuse the promoted
+// variable, and the shared allocation outlives whichever of them dies first.
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+static struct Block_layout *layout(void *block) {
+    return (struct Block_layout *)block;
+}
+
+int main() {
+    __block int counter = 0;
+    __block long total = 0;
+
+    void (^first)(void) = Block_copy(^{ counter++; total += counter; });
+    testassert(layout(first)->flags & BLOCK_COALLOCATED);
+
+    // counter is already on the heap, so this copy is allocated alone.
+    void (^second)(void) = Block_copy(^{ counter += 10; });
+    testassert(!(layout(second)->flags & BLOCK_COALLOCATED));
+
+    first();
+    second();
+    testassert(counter == 11);
+    testassert(total == 1);
+
+    // counter and total stay valid after the block they were
+    // allocated with is gone.
+    Block_release(first);
+    second();
+    testassert(counter == 21);
+    Block_release(second);
+    testassert(counter == 21);
+
+    // Nested copies: the inner block is copied first and takes the
+    // variable with it.
+    __block int inner = 0;
+    void (^innerBlock)(void) = ^{ inner++; };
+    void (^outer)(void) = Block_copy(^{ innerBlock(); });
+    outer();
+    testassert(inner == 1);
+    Block_release(outer);
+
+    for (int i = 0; i < 10000; i++) {
+        __block int value = i;
+        void (^b)(void) = Block_copy(^{ value++; });
+        b();
+        testassert(value == i + 1);
+        Block_release(b);
+    }
+
+    succeed(__FILE__);
+}
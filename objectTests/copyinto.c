@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_copy_into copies a block into caller storage, promoting its
+// __block variables, and refuses storage that is too small.
+// Block_destroy_in_place releases what the copy holds.
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+struct slot {
+    void *storage[8];
+};
+
+int main() {
+    __block int counter = 0;
+    struct slot slots[4];
+
+    void (^block)(void) = ^{ counter++; };
+    testassert(Block_copy_into(slots, Block_size(block) - 1, block) == NULL);
+
+    for (int i = 0; i < 4; i++) {
+        void (^copy)(void) = Block_copy_into(&slots[i], sizeof(slots[i]), block);
+        testassert(copy == (void *)&slots[i]);
+        testassert(!(((struct Block_layout *)copy)->flags & BLOCK_NEEDS_FREE));
+        copy();
+    }
+    testassert(counter == 4);
+
+    // A heap copy of an in-place copy is an ordinary heap block.
+    void (^first)(void) = (void (^)(void))(void *)&slots[0];
+    void (^heap)(void) = Block_copy(first);
+    testassert(heap != first);
+    heap();
+    Block_release(heap);
+
+    for (int i = 0; i < 4; i++) {
+        Block_destroy_in_place(&slots[i]);
+    }
+    block();
+    testassert(counter == 6);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_copy_move lets a copy helper move captured C++ objects out of the
+// stack block being promoted. Helpers that do not ask still copy.
+
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+int copies = 0;
+int moves = 0;
+
+class Payload {
+public:
+    Payload() : data(new int[64]) { }
+    Payload(const Payload &other) : data(new int[64]) {
+        ++copies;
+        memcpy(data, other.data, 64 * sizeof(int));
+    }
+    Payload(Payload &&other) : data(other.data) {
+        ++moves;
+        other.data = NULL;
+    }
+    ~Payload() { delete[] data; }
+    int *data;
+};
+
+// A block as the compiler lays it out, with a helper that moves when asked.
+struct payload_block {
+    struct Block_layout layout;
+    Payload payload;
+};
+
+static void payload_copy(void *dst, const void *src) {
+    payload_block *to = (payload_block *)dst;
+    payload_block *from = (payload_block *)src;
+    if (_Block_copy_is_move(from)) {
+        new (&to->payload) Payload(static_cast<Payload &&>(from->payload));
+    } else {
+        new (&to->payload) Payload(from->payload);
+    }
+}
+
+static void payload_dispose(const void *block) {
+    ((payload_block *)block)->payload.~Payload();
+}
+
+static struct {
+    struct Block_descriptor_1 d1;
+    struct Block_descriptor_2 d2;
+} payload_descriptor = {
+    { 0, sizeof(payload_block) },
+    { payload_copy, payload_dispose },
+};
+
+static void payload_invoke(void *block) {
+    testassert(((payload_block *)block)->payload.data[0] == 42);
+}
+
+int main() {
+    payload_block stack;
+    memset(&stack.layout, 0, sizeof(stack.layout));
+    stack.layout.isa = _NSConcreteStackBlock;
+    stack.layout.flags = BLOCK_HAS_COPY_DISPOSE | BLOCK_HAS_CTOR;
+    stack.layout.invoke = (__typeof(stack.layout.invoke))payload_invoke;
+    stack.layout.descriptor = &payload_descriptor.d1;
+    new (&stack.payload) Payload();
+    stack.payload.data[0] = 42;
+
+    void (^copied)(void) = (void (^)(void))Block_copy(&stack);
+    testassert(copies == 1 && moves == 0);
+    testassert(stack.payload.data != NULL);
+
+    void (^moved)(void) = (void (^)(void))Block_copy_move(&stack);
+    testassert(copies == 1 && moves == 1);
+    testassert(stack.payload.data == NULL);
+    copied();
+    moved();
+
+    // Copying a heap block only retains it.
+    testassert(Block_copy_move(moved) == (void *)moved);
+    Block_release(moved);
+    Block_release(moved);
+    Block_release(copied);
+    stack.payload.~Payload();
+
+    // Helpers generated by the compiler copy.
+    Payload captured;
+    captured.data[0] = 42;
+    int before = copies;
+    void (^block)(void) = Block_copy_move(^{ testassert(captured.data[0] == 42); });
+    testassert(copies > before);
+    block();
+    Block_release(block);
+
+    succeed(__FILE__);
+}
@@ -71,6 +71,21 @@ void *testlatch(void *arg __unused) {
     return NULL;
 }
 
+// test that balanced retains past the inline refcount limit still free
+void *testoverflow(void *arg __unused) {
+    TestObject *to = [TestObject new];
+    void (^b)(void) = [^{ printf("hi %p\n", to); } copy];
+    for (int i = 0; i < 0xfffff; ++i) {
+        (void)Block_copy(b);
+    }
+    for (int i = 0; i < 0xfffff; ++i) {
+        Block_release(b);
+    }
+    [b release];
+    [to release];
+    return NULL;
+}
+
 void *testmultiple(void *arg __unused) {
     TestObject *to = [TestObject new];
     void (^b)(void) = [^{ printf("hi %p\n", to); } copy];
@@ -104,6 +119,10 @@ int main() {
     pthread_join(th, NULL);
     recoverMemory("testlatch");
 
+    pthread_create(&th, NULL, testoverflow, NULL);
+    pthread_join(th, NULL);
+    recoverMemory("testoverflow");
+
     pthread_create(&th, NULL, testmultiple, NULL);
     pthread_join(th, NULL);
     recoverMemory("testmultiple");
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_release_deferred holds releases until Block_drain_deferred, a full
+// buffer, or thread exit, and coalesces repeated releases of one block.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define MANY 1000
+
+typedef int (^block_t)(void);
+
+static block_t make(int value) {
+    return Block_copy(^{ return value; });
+}
+
+static void *deferAndExit(void *arg __unused) {
+    block_t b = make(1);
+    Block_release_deferred(b);
+    return NULL;
+}
+
+int main() {
+    testuse_counting_alloc();
+
+    // Coalesced releases of one block.
+    block_t b = make(42);
+    for (int i = 0; i < MANY; i++) {
+        (void)Block_copy(b);
+    }
+    for (int i = 0; i < MANY; i++) {
+        Block_release_deferred(b);
+    }
+    testassert(b() == 42);
+    Block_drain_deferred();
+    testassert(testfrees == 0);
+    Block_release_deferred(b);
+    testassert(testfrees == 0);
+    Block_drain_deferred();
+    testassert(testfrees == 1);
+
+    // More distinct blocks than one batch holds.
+    static block_t blocks[MANY];
+    for (int i = 0; i < MANY; i++) {
+        blocks[i] = make(i);
+    }
+    for (int i = 0; i < MANY; i++) {
+        Block_release_deferred(blocks[i]);
+    }
+    testassert(testfrees > 1  &&  testfrees < 1 + MANY);
+    Block_drain_deferred();
+    testassert(testfrees == 1 + MANY);
+
+    // Thread exit drains.
+    pthread_t th;
+    pthread_create(&th, NULL, deferAndExit, NULL);
+    pthread_join(th, NULL);
+    testassert(testfrees == 2 + MANY);
+
+    succeed(__FILE__);
+}
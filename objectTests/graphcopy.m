@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_copy_graph copies a block, the stack blocks it captures and their
+// __block variables into one allocation. Parts of the graph stay valid as
+// long as anything references them.
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+int main() {
+    __block int counter = 0;
+
+    void (^leaf)(void) = ^{ counter++; };
+    void (^middle)(void) = ^{ leaf(); leaf(); };
+    void (^top)(void) = ^{ middle(); leaf(); };
+
+    void (^copy)(void) = Block_copy_graph(top);
+    testassert(((struct Block_layout *)copy)->flags & BLOCK_COALLOCATED);
+    copy();
+    testassert(counter == 3);
+
+    // The copy of leaf is shared by top and middle.
+    void (^deep)(void) = ^{ copy(); };
+    void (^kept)(void) = Block_copy(deep);
+    Block_release(copy);
+    kept();
+    testassert(counter == 6);
+    Block_release(kept);
+
+    // Chains are copied without recursing.
+    void (^c1)(void) = ^{ leaf(); };
+    void (^c2)(void) = ^{ c1(); };
+    void (^c3)(void) = ^{ c2(); };
+    void (^c4)(void) = ^{ c3(); };
+    void (^c5)(void) = ^{ c4(); };
+    for (int i = 0; i < 10; i++) {
+        void (^heap)(void) = Block_copy_graph(c5);
+        heap();
+        Block_release(heap);
+    }
+    testassert(counter == 16);
+
+    // A block captured twice, and reached along both sides of a diamond,
+    // holds a reference for every capture.
+    __block void (^exported)(void) = NULL;
+    void (^shared)(void) = ^{ counter++; };
+    void (^alias)(void) = shared;
+    void (^twice)(void) = ^{ shared(); alias(); exported = Block_copy(alias); };
+    copy = Block_copy_graph(twice);
+    copy();
+    testassert(counter == 18);
+    testassert((((struct Block_layout *)exported)->flags & BLOCK_REFCOUNT_MASK) == 6);
+    Block_release(copy);
+    exported();
+    testassert(counter == 19);
+    Block_release(exported);
+
+    void (^left)(void) = ^{ shared(); };
+    void (^right)(void) = ^{ exported = Block_copy(shared); };
+    void (^diamond)(void) = ^{ left(); right(); };
+    copy = Block_copy_graph(diamond);
+    copy();
+    testassert(counter == 20);
+    testassert((((struct Block_layout *)exported)->flags & BLOCK_REFCOUNT_MASK) == 6);
+    Block_release(copy);
+    exported();
+    testassert(counter == 21);
+    Block_release(exported);
+
+    succeed(__FILE__);
+}
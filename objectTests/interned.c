@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_copy_interned shares one copy between stack blocks with the same
+// code and the same captured values, and copies everything else normally.
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+typedef int (^filter_t)(int);
+
+static filter_t makeFilter(int low, int high) {
+    return Block_copy_interned(^(int x) { return x >= low && x <= high; });
+}
+
+int main() {
+    filter_t a = makeFilter(1, 10);
+    filter_t b = makeFilter(1, 10);
+    filter_t c = makeFilter(2, 10);
+
+    testassert(a == b);
+    testassert(a != c);
+    testassert(a(5) && !a(11));
+    testassert(!c(1) && c(2));
+
+    // Interned copies are immortal; copying and releasing them is allowed.
+    testassert(Block_copy(a) == a);
+    Block_release(a);
+    Block_release(a);
+    Block_release(b);
+    Block_release(c);
+    testassert(a(10));
+
+    // Blocks with helpers are copied as by Block_copy.
+    __block int counter = 0;
+    void (^counting)(void) = Block_copy_interned(^{ counter++; });
+    testassert(((struct Block_layout *)counting)->flags & BLOCK_NEEDS_FREE);
+    counting();
+    testassert(counter == 1);
+    Block_release(counting);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+// TEST_CFLAGS -lffi
+
+// _Block_invoke_dynamic calls blocks from an array of argument pointers
+// using their signatures, including mixed integer and floating-point
+// arguments and large struct returns. Where libffi's header is available,
+// run with VERBOSE=2 to print the cost of a call against ffi_call with a
+// prepared call interface.
+
+#include <stdio.h>
+#include <time.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#if __has_include(<ffi/ffi.h>)
+#include <ffi/ffi.h>
+#define HAVE_FFI 1
+#elif __has_include(<ffi.h>)
+#include <ffi.h>
+#define HAVE_FFI 1
+#endif
+
+#define CALLS 1000000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct big {
+    double x, y, z;
+    long n;
+};
+
+int main() {
+#if defined(__x86_64__) || defined(__arm64__) || defined(__aarch64__)
+    int base = 10;
+    int (^mixed)(char, double, float, long long) =
+        ^(char c, double d, float f, long long q) {
+            return (int)(base + c + d + f + q);
+        };
+    char c = -2;
+    double d = 2.5;
+    float f = 0.5f;
+    long long q = 100;
+    void *args[] = { &c, &d, &f, &q };
+    int result = 0;
+    for (int i = 0; i < 3; i++) {
+        testassert(_Block_invoke_dynamic(mixed, &result, args));
+        testassert(result == 111);
+    }
+
+    struct big (^make)(long, double) = ^(long n, double y) {
+        struct big value = { 1.0, y, 3.0, n + base };
+        return value;
+    };
+    long n = 5;
+    void *makeArgs[] = { &n, &d };
+    struct big value;
+    testassert(_Block_invoke_dynamic(make, &value, makeArgs));
+    testassert(value.x == 1.0 && value.y == 2.5 && value.z == 3.0 && value.n == 15);
+
+    __block int called = 0;
+    void (^nothing)(void) = ^{ called++; };
+    testassert(_Block_invoke_dynamic(nothing, NULL, NULL));
+    testassert(called == 1);
+
+    double begin = now();
+    for (int i = 0; i < CALLS; i++) {
+        _Block_invoke_dynamic(mixed, &result, args);
+    }
+    double dynamic = now() - begin;
+    testassert(result == 111);
+    testprintf("_Block_invoke_dynamic %.1f ns/call\n", dynamic * 1e9 / CALLS);
+
+#if HAVE_FFI
+    ffi_cif cif;
+    ffi_type *types[] = { &ffi_type_pointer, &ffi_type_schar, &ffi_type_double,
+                          &ffi_type_float, &ffi_type_sint64 };
+    testassert(ffi_prep_cif(&cif, FFI_DEFAULT_ABI, 5, &ffi_type_sint32, types) == FFI_OK);
+    void *blockArg = (void *)mixed;
+    void *ffiArgs[] = { &blockArg, &c, &d, &f, &q };
+    void (*invoke)(void) = (void (*)(void))((struct Block_layout *)blockArg)->invoke;
+    ffi_arg ffiResult = 0;
+    begin = now();
+    for (int i = 0; i < CALLS; i++) {
+        ffi_call(&cif, invoke, &ffiResult, ffiArgs);
+    }
+    double ffi = now() - begin;
+    testassert((int)ffiResult == 111);
+    testprintf("ffi_call %.1f ns/call\n", ffi * 1e9 / CALLS);
+#endif
+#endif
+
+    succeed(__FILE__);
+}
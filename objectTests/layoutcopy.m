@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CFLAGS -framework Foundation
+
+// Blocks with an extended layout are copied and disposed from the layout
+// rather than through their helpers. Captured objects must still be
+// retained and released, captured blocks copied, and __block variables
+// shared, exactly as the helpers would.
+
+#import <stdio.h>
+#import <Block.h>
+#import <Block_private.h>
+#import <Foundation/Foundation.h>
+#import "test.h"
+
+int Retained = 0;
+
+@interface TestObject : NSObject
+@end
+
+@implementation TestObject
+- (id)retain {
+    ++Retained;
+    return [super retain];
+}
+- (oneway void)release {
+    --Retained;
+    [super release];
+}
+@end
+
+int main() {
+    TestObject *first = [[TestObject alloc] init];
+    TestObject *second = [[TestObject alloc] init];
+    __block int counter = 0;
+    int inner = 0;
+    void (^innerBlock)(void) = ^{ counter += inner + 1; };
+
+    for (int i = 0; i < 100; i++) {
+        void (^block)(void) = Block_copy(^{
+            [first self];
+            [second self];
+            innerBlock();
+            counter++;
+        });
+        testassert(Retained == 2);
+        struct Block_layout *layout = (struct Block_layout *)block;
+        testassert(layout->flags & BLOCK_HAS_EXTENDED_LAYOUT);
+        block();
+        Block_release(block);
+        testassert(Retained == 0);
+    }
+    testassert(counter == 200);
+
+    [first release];
+    [second release];
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_parallel_apply calls the block once per index, also when calls
+// nest. Run with VERBOSE=2 to print timings against a serial loop, and
+// build with -fopenmp to add an OpenMP loop to the comparison.
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <Block.h>
+#include "test.h"
+
+#define COUNT 1000000
+#define OUTER 100
+#define INNER 1000
+
+static int hits[COUNT];
+static double input[COUNT];
+static double output[COUNT];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void work(size_t i) {
+    output[i] = sqrt(input[i]) * sin(input[i]);
+}
+
+int main() {
+    __block long sum = 0;
+    Block_parallel_apply(COUNT, ^(size_t i) {
+        __sync_fetch_and_add(&hits[i], 1);
+        __sync_fetch_and_add(&sum, (long)i);
+    });
+    testassert(sum == (long)COUNT * (COUNT - 1) / 2);
+    for (int i = 0; i < COUNT; i++) testassert(hits[i] == 1);
+
+    Block_parallel_apply(OUTER, ^(size_t i) {
+        Block_parallel_apply(INNER, ^(size_t j) {
+            __sync_fetch_and_add(&hits[i * INNER + j], 1);
+        });
+    });
+    for (int i = 0; i < OUTER * INNER; i++) testassert(hits[i] == 2);
+
+    Block_parallel_apply(0, ^(size_t i) {
+        (void)i;
+        fail("called for an empty range");
+    });
+
+    for (int i = 0; i < COUNT; i++) input[i] = i;
+    void (^body)(size_t) = ^(size_t i) { work(i); };
+
+    double begin = now();
+    for (size_t i = 0; i < COUNT; i++) body(i);
+    double serial = now() - begin;
+
+    begin = now();
+    Block_parallel_apply(COUNT, body);
+    double parallel = now() - begin;
+    testprintf("serial loop %.2f ms, Block_parallel_apply %.2f ms\n",
+               serial * 1e3, parallel * 1e3);
+
+#if _OPENMP
+    begin = now();
+#pragma omp parallel for
+    for (long i = 0; i < COUNT; i++) body(i);
+    testprintf("OpenMP %.2f ms\n", (now() - begin) * 1e3);
+#endif
+
+    succeed(__FILE__);
+}
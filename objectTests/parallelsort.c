@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_parallel_sort sorts stably through a comparator block. Run with
+// VERBOSE=2 to print timings against qsort with the same comparison.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <Block.h>
+#include "test.h"
+
+#define COUNT 2000000
+
+struct record {
+    uint32_t key;
+    uint32_t order;
+};
+
+static struct record records[COUNT];
+static struct record copy[COUNT];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare(const void *a, const void *b) {
+    uint32_t x = ((const struct record *)a)->key;
+    uint32_t y = ((const struct record *)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+static void fill(uint32_t range) {
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < COUNT; i++) {
+        seed = seed * 1103515245 + 12345;
+        records[i].key = (seed >> 8) % range;
+        records[i].order = i;
+    }
+}
+
+static void check_sorted(size_t count) {
+    for (size_t i = 1; i < count; i++) {
+        testassert(records[i - 1].key <= records[i].key);
+        if (records[i - 1].key == records[i].key) {
+            testassert(records[i - 1].order < records[i].order);
+        }
+    }
+}
+
+int main() {
+    int (^byKey)(const void *, const void *) = ^(const void *a, const void *b) {
+        return compare(a, b);
+    };
+
+    // Few distinct keys, so stability shows.
+    fill(100);
+    testassert(Block_parallel_sort(records, COUNT, sizeof(struct record), byKey) == 0);
+    check_sorted(COUNT);
+
+    fill(UINT32_MAX);
+    testassert(Block_parallel_sort(records, 1000, sizeof(struct record), byKey) == 0);
+    check_sorted(1000);
+
+    testassert(Block_parallel_sort(records, 1, sizeof(struct record), byKey) == 0);
+    testassert(Block_parallel_sort(records, 10, 0, byKey) == -1);
+    testassert(errno == EINVAL);
+
+    fill(UINT32_MAX);
+    memcpy(copy, records, sizeof(records));
+    double begin = now();
+    qsort(copy, COUNT, sizeof(struct record), compare);
+    double serial = now() - begin;
+
+    begin = now();
+    testassert(Block_parallel_sort(records, COUNT, sizeof(struct record), byKey) == 0);
+    double parallel = now() - begin;
+    check_sorted(COUNT);
+    testprintf("qsort %.1f ms, Block_parallel_sort %.1f ms\n",
+               serial * 1e3, parallel * 1e3);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// A pinned heap block is immortal: copies and releases on many threads
+// leave its flags untouched, and Block_unpin gives back the pinned
+// reference.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define THREADS 4
+#define ROUNDS 100000
+
+typedef int (^block_t)(void);
+
+static block_t handler;
+
+static void *worker(void *arg __unused) {
+    for (int i = 0; i < ROUNDS; i++) {
+        block_t b = Block_copy(handler);
+        testassert(b == handler);
+        testassert(b() == 42);
+        Block_release(b);
+    }
+    return NULL;
+}
+
+int main() {
+    testuse_counting_alloc();
+
+    int answer = 42;
+    handler = Block_copy(^{ return answer; });
+    block_t extra = Block_copy(handler);
+
+    Block_pin(handler);
+    int32_t flags = ((struct Block_layout *)(void *)handler)->flags;
+    testassert(flags & BLOCK_PINNED);
+
+    pthread_t th[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&th[i], NULL, worker, NULL);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    testassert(((struct Block_layout *)(void *)handler)->flags == flags);
+
+    Block_unpin(handler);
+    testassert(testfrees == 0);
+    Block_release(extra);
+    testassert(testfrees == 1);
+
+    succeed(__FILE__);
+}
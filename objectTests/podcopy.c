@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Blocks that capture only plain data are copied with fixed-size kernels
+// for the common sizes. Every size must still copy every captured byte.
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+struct twelve { long words[12]; };
+
+int main() {
+    char c = 1;
+    int i = 2;
+    long l = 3;
+    double d = 4.0;
+    struct twelve t;
+    for (int n = 0; n < 12; n++) t.words[n] = n * 10;
+
+    long (^b1)(void) = Block_copy(^{ return (long)c; });
+    long (^b2)(void) = Block_copy(^{ return c + i + l; });
+    long (^b3)(void) = Block_copy(^{ return c + i + l + (long)d; });
+    long (^b4)(void) = Block_copy(^{ return t.words[0] + t.words[11] + l; });
+
+    testassert(b1() == 1);
+    testassert(b2() == 6);
+    testassert(b3() == 10);
+    testassert(b4() == 113);
+
+    struct Block_layout *layout = (struct Block_layout *)b3;
+    testassert(layout->isa == _NSConcreteMallocBlock);
+    testassert(layout->flags & BLOCK_NEEDS_FREE);
+    testassert((layout->flags & BLOCK_REFCOUNT_MASK) == 2);
+
+    Block_release(b1);
+    Block_release(b2);
+    Block_release(b3);
+    Block_release(b4);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Contention benchmark for block refcounts.
+// Every online CPU retains and releases the same heap block. Run with VERBOSE=2 to print the throughput; compare against a
+// build of the previous runtime to measure a change.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define MAX_THREADS 64
+#define ROUNDS 1000000
+
+static void (^shared)(void);
+static volatile int ready;
+static volatile int go;
+
+static void *worker(void *arg __unused) {
+    __sync_fetch_and_add(&ready, 1);
+    while (!go) { }
+    for (int i = 0; i < ROUNDS; i++) {
+        void (^b)(void) = Block_copy(shared);
+        testassert(b == shared);
+        Block_release(b);
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (int)cpus;
+
+    __block long counter = 0;
+    shared = Block_copy(^{ counter++; });
+
+    pthread_t th[MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&th[i], NULL, worker, NULL);
+    }
+    while (ready < threads) { }
+    double begin = now();
+    go = 1;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(th[i], NULL);
+    }
+    double elapsed = now() - begin;
+
+    testprintf("%d threads: %.1f M retain/release pairs per second\n",
+               threads, threads * (double)ROUNDS / elapsed / 1e6);
+
+    // Every retain was balanced: one reference left.
+    testassert((((struct Block_layout *)(void *)shared)->flags & BLOCK_REFCOUNT_MASK) == 2);
+    shared();
+    testassert(counter == 1);
+    Block_release(shared);
+
+    succeed(__FILE__);
+}
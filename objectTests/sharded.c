@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// A sharded block keeps an exact count across per-CPU counters: it
+// survives while sharded, Block_unshard may race with other threads'
+// copies and releases, and the last release afterwards frees it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define THREADS 8
+#define ROUNDS 100000
+
+typedef int (^block_t)(void);
+
+static block_t shared;
+
+static void *worker(void *arg __unused) {
+    for (int i = 0; i < ROUNDS; i++) {
+        block_t b = Block_copy(shared);
+        block_t b2 = Block_copy(b);
+        testassert(b2() == 42);
+        Block_release(b);
+        Block_release(b2);
+    }
+    return NULL;
+}
+
+int main() {
+    testuse_counting_alloc();
+
+    for (int round = 0; round < 2; round++) {
+        int answer = 42;
+        shared = Block_copy(^{ return answer; });
+        block_t kept = Block_copy(shared);
+        Block_shard(shared);
+
+        pthread_t th[THREADS];
+        for (int i = 0; i < THREADS; i++) {
+            pthread_create(&th[i], NULL, worker, NULL);
+        }
+        // The second round unshards while the workers are running.
+        if (round == 1) Block_unshard(shared);
+        for (int i = 0; i < THREADS; i++) {
+            pthread_join(th[i], NULL);
+        }
+        if (round == 0) Block_unshard(shared);
+
+        testassert(testfrees == round);
+        testassert((((struct Block_layout *)(void *)kept)->flags & BLOCK_REFCOUNT_MASK) == 2);
+        Block_release(kept);
+        testassert(testfrees == round + 1);
+    }
+
+    succeed(__FILE__);
+}
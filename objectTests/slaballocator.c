@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+// TEST_ENV LIBCLOSURE_SLAB_ALLOCATOR=YES
+
+// Heap copies of small blocks come from the slab allocator.
+// Exercise every size class from several threads, including blocks that
+// are released on a different thread than the one that copied them.
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define THREADS 4
+#define ROUNDS 10000
+
+typedef struct { char bytes[200]; } Big;
+
+static void * volatile handoff[THREADS];
+
+static void *worker(void *arg) {
+    long me = (long)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        int small = i;
+        long two[2] = { i, -i };
+        Big big;
+        memset(&big, i & 0xff, sizeof(big));
+        __block int counter = 0;
+
+        int (^b1)(void) = Block_copy(^{ return small; });
+        long (^b2)(void) = Block_copy(^{ return two[0] + two[1]; });
+        int (^b3)(void) = Block_copy(^{ return (int)big.bytes[199]; });
+        void (^b4)(void) = Block_copy(^{ counter++; });
+
+        testassert(b1() == small);
+        testassert(b2() == 0);
+        testassert(b3() == (char)(i & 0xff));
+        b4();
+        testassert(counter == 1);
+
+        // Released by a neighbour thread, so frees cross magazines.
+        void *old = __sync_lock_test_and_set(&handoff[(me + 1) % THREADS], (void *)b1);
+        if (old) Block_release(old);
+
+        Block_release(b2);
+        Block_release(b3);
+        Block_release(b4);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t threads[THREADS];
+    for (long i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    }
+    for (long i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (long i = 0; i < THREADS; i++) {
+        if (handoff[i]) Block_release(handoff[i]);
+    }
+
+    succeed(__FILE__);
+}
@@ -407,6 +407,36 @@ static inline BOOL stret_equal(struct stret a, struct stret b)
 static struct stret STRET_RESULT __attribute__((used)) = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
 
 
+/* Counting allocator for heap block storage */
+
+#ifdef _BLOCK_PRIVATE_H_
+// testuse_counting_alloc() makes the runtime allocate heap blocks and
+// __block variables with malloc, counting the calls in testallocs and
+// testfrees. Call it before anything is copied to the heap.
+static volatile int testallocs __attribute__((used));
+static volatile int testfrees __attribute__((used));
+
+static inline void *testcounting_alloc(size_t size)
+{
+    __sync_fetch_and_add(&testallocs, 1);
+    return malloc(size);
+}
+
+static inline void testcounting_free(void *ptr, size_t size __unused)
+{
+    __sync_fetch_and_add(&testfrees, 1);
+    free(ptr);
+}
+
+static inline void testuse_counting_alloc(void)
+{
+    Block_callbacks_alloc callbacks = {
+        sizeof(callbacks), testcounting_alloc, NULL, testcounting_free
+    };
+    _Block_use_alloc(&callbacks);
+}
+#endif
+
 #if TARGET_OS_SIMULATOR
 // Force cwd to executable's directory during launch.
 // sim used to do this but simctl does not.
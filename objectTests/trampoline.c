@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// Block_trampoline_create turns a block into a plain C function pointer,
+// here for qsort. Trampolines are reused after Block_trampoline_destroy.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <Block.h>
+#include "test.h"
+
+typedef int (*compare_t)(const void *, const void *);
+typedef long (*add_t)(long, long);
+
+int main() {
+    int descending = 1;
+    int calls = 0;
+    __block int *callsp = &calls;
+    compare_t compare = (compare_t)Block_trampoline_create(^(const void *a, const void *b) {
+        (*callsp)++;
+        int x = *(const int *)a, y = *(const int *)b;
+        return descending ? y - x : x - y;
+    });
+    if (!compare) {
+        // No executable memory on this platform.
+        succeed(__FILE__);
+    }
+
+    int values[] = { 3, 9, 1, 7, 5 };
+    qsort(values, 5, sizeof(int), compare);
+    testassert(values[0] == 9 && values[4] == 1);
+    testassert(calls > 0);
+    Block_trampoline_destroy((void *)compare);
+
+    for (long i = 0; i < 10000; i++) {
+        add_t add = (add_t)Block_trampoline_create(^(long a, long b) { return a + b + i; });
+        testassert(add(1, 2) == 3 + i);
+        Block_trampoline_destroy((void *)add);
+    }
+
+    succeed(__FILE__);
+}
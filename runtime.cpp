@@ -10,9 +10,23 @@
 
 #include "Block_private.h"
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atomic>
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#define BLOCK_TRAMPOLINES 1
+#include <sys/mman.h>
+#else
+#define BLOCK_TRAMPOLINES 0
+#endif
+#if __APPLE__ && __has_include(<os/tsd.h>)
+#include <os/tsd.h>
+#endif
 #include <os/assumes.h>
 #ifndef os_assumes
 #define os_assumes(_x) os_assumes(_x)
@@ -50,44 +64,96 @@ static __inline bool OSAtomicCompareAndSwapInt(int oldi, int newi, int volatile
 Internal Utilities
 ********************************************************************************/
 
+// The refcount field holds 15 bits. Counts beyond that spill into a side
+// table (see "Refcount overflow" below) instead of latching the block
+// immortal; BLOCK_REFCOUNT_OVERFLOW marks a field with a spilled count.
+// Both helpers are only reached at the extremes of the inline range.
+static bool _Block_refcount_spill(volatile int32_t *where, int32_t old_value);
+static bool _Block_refcount_unspill(volatile int32_t *where, int32_t old_value);
+
+// The flags word is a volatile int32_t in the compiler's ABI; the runtime
+// operates on it, and on the reserved word of heap blocks, as an atomic of
+// the same size and alignment.
+static inline std::atomic<int32_t> *_Block_atomic_int(volatile int32_t *where) {
+    static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t) &&
+                  alignof(std::atomic<int32_t>) == alignof(int32_t),
+                  "refcounts require a plain-int atomic");
+    return reinterpret_cast<std::atomic<int32_t> *>(const_cast<int32_t *>(where));
+}
+
 // 传实参 &aBlock->flags 过来，
 // 增加 Block 的引用计数
+// A retain needs no ordering: the caller already holds a reference.
+// It stays a CAS rather than a fetch_add because an add racing with a
+// full field would carry into the flag bits above the refcount.
 static int32_t latching_incr_int(volatile int32_t *where) {
+    std::atomic<int32_t> *flags = _Block_atomic_int(where);
+    int32_t old_value = flags->load(std::memory_order_relaxed);
     while (1) {
-        int32_t old_value = *where;
         // 如果 flags 含有 BLOCK_REFCOUNT_MASK 证明其引用计数达到最大，
-        // 直接返回，需要三万多个指针指向，正常情况下不会出现。
+        // 把一半的引用计数转移到 side table 中。
         // BLOCK_REFCOUNT_MASK =     (0xfffe)
         // 0x1111 1111 1111 1110 // 10 进制 == 65534 // 以 2 为单位，每次递增 2
         if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK) {
-            return BLOCK_REFCOUNT_MASK;
+            if (_Block_refcount_spill(where, old_value)) {
+                return BLOCK_REFCOUNT_MASK;
+            }
+            old_value = flags->load(std::memory_order_relaxed);
+            continue;
         }
         
-        // 做一次原子性判断其值当前是否被其他线程改动，
-        // 如果被改动就进入下一次循环直到改动结束后赋值。
-        // OSAtomicCompareAndSwapInt 的作用就是在 where 取值与 old_value 相同时，
-        // 将 old_value + 2 赋给 where
         // 注: Block 的引用计数以 flags 的后 16 位代表，
         // 以 2 为单位，每次递增 2，1 为 BLOCK_DEALLOCATING，表示正在释放占用。
-        if (OSAtomicCompareAndSwapInt(old_value, old_value+2, where)) {
+        // 失败时 compare_exchange 会把当前值写回 old_value
+        if (flags->compare_exchange_weak(old_value, old_value+2,
+                                         std::memory_order_relaxed)) {
             return old_value+2;
         }
     }
 }
 
+// Add n references at once, spilling to the side table as needed.
+static void latching_incr_int_n(volatile int32_t *where, uint32_t n) {
+    std::atomic<int32_t> *flags = _Block_atomic_int(where);
+    int32_t old_value = flags->load(std::memory_order_relaxed);
+    while (n) {
+        uint32_t room = (BLOCK_REFCOUNT_MASK - (old_value & BLOCK_REFCOUNT_MASK)) / 2;
+        if (room == 0) {
+            if (_Block_refcount_spill(where, old_value)) n--;
+            old_value = flags->load(std::memory_order_relaxed);
+            continue;
+        }
+        uint32_t step = n < room ? n : room;
+        if (flags->compare_exchange_weak(old_value, old_value + 2 * (int32_t)step,
+                                         std::memory_order_relaxed)) {
+            n -= step;
+            old_value += 2 * (int32_t)step;
+        }
+    }
+}
+
 // 是否增加引用计数
+// Acquire so that a reference revived from a weak pointer sees the block's
+// contents.
 static bool latching_incr_int_not_deallocating(volatile int32_t *where) {
+    std::atomic<int32_t> *flags = _Block_atomic_int(where);
+    int32_t old_value = flags->load(std::memory_order_relaxed);
     while (1) {
-        int32_t old_value = *where;
         if (old_value & BLOCK_DEALLOCATING) {
             // if deallocating we can't do this
             return false;
         }
         if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK) {
-            // if latched, we're leaking this block, and we succeed
-            return true;
+            // inline count is full, spill half of it to the side table
+            if (_Block_refcount_spill(where, old_value)) {
+                return true;
+            }
+            old_value = flags->load(std::memory_order_relaxed);
+            continue;
         }
-        if (OSAtomicCompareAndSwapInt(old_value, old_value+2, where)) {
+        if (flags->compare_exchange_weak(old_value, old_value+2,
+                                         std::memory_order_acquire,
+                                         std::memory_order_relaxed)) {
             // otherwise, we must store a new retained value without the deallocating bit set
             return true;
         }
@@ -97,15 +163,24 @@ static bool latching_incr_int_not_deallocating(volatile int32_t *where) {
 // return should_deallocate?
 // 实参传入 &aBlock->flags
 // 是否减小 block 引用
+// Releases publish the caller's writes; the release that deallocates also
+// acquires everyone else's before the dispose helper runs.
 static bool latching_decr_int_should_deallocate(volatile int32_t *where) {
-    while (1) {
-        int32_t old_value = *where;
-        
-        // 如果是引用计数为 0xfffe，返回 false 不做处理
-        if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK) {
-            return false; // latched high
+    std::atomic<int32_t> *flags = _Block_atomic_int(where);
+    int32_t old_value = flags->load(std::memory_order_relaxed);
+
+    // Fast path: another reference is outstanding, so one fetch_sub drops
+    // ours. If concurrent releases made ours the last one after all, put it
+    // back and let the CAS loop below deallocate or unspill.
+    if ((old_value & BLOCK_REFCOUNT_MASK) > 2) {
+        old_value = flags->fetch_sub(2, std::memory_order_release);
+        if ((old_value & BLOCK_REFCOUNT_MASK) > 2) {
+            return false;
         }
-        
+        old_value = flags->fetch_add(2, std::memory_order_relaxed) + 2;
+    }
+
+    while (1) {
         // 如果引用计数为 0，返回 false 不做处理
         if ((old_value & BLOCK_REFCOUNT_MASK) == 0) {
             return false;   // underflow, latch low
@@ -117,16 +192,45 @@ static bool latching_decr_int_should_deallocate(volatile int32_t *where) {
         
         // 如果引用计数为 2，将其减 1，为 BLOCK_DEALLOCATING，标明正在释放，返回 true
         if ((old_value & (BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING)) == 2) {
+            if (old_value & BLOCK_REFCOUNT_OVERFLOW) {
+                // 引用计数还有一部分在 side table 中，取回来
+                if (_Block_refcount_unspill(where, old_value)) {
+                    return false;
+                }
+                old_value = flags->load(std::memory_order_relaxed);
+                continue;
+            }
             new_value = old_value - 1;
             result = true;
         }
 
-        if (OSAtomicCompareAndSwapInt(old_value, new_value, where)) {
+        if (flags->compare_exchange_weak(old_value, new_value,
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_relaxed)) {
             return result;
         }
     }
 }
 
+// Drop n references at once. Falls back to one at a time when these might
+// include the last inline reference.
+static bool latching_decr_int_n_should_deallocate(volatile int32_t *where, uint32_t n) {
+    std::atomic<int32_t> *flags = _Block_atomic_int(where);
+    int32_t old_value = flags->load(std::memory_order_relaxed);
+    while (n < BLOCK_REFCOUNT_MASK / 2 &&
+           (uint32_t)(old_value & BLOCK_REFCOUNT_MASK) > 2 * n) {
+        if (flags->compare_exchange_weak(old_value, old_value - 2 * (int32_t)n,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+            return false;
+        }
+    }
+    while (n--) {
+        if (latching_decr_int_should_deallocate(where)) return true;
+    }
+    return false;
+}
+
 
 /**************************************************************************
 Framework callback functions and their default implementations.
@@ -156,311 +260,3857 @@ void _Block_use_RR2(const Block_callbacks_RR *callbacks) {
     _Block_destructInstance = callbacks->destructInstance;
 }
 
-/****************************************************************************
-Accessors for block descriptor fields
-*****************************************************************************/
-#if 0
-static struct Block_descriptor_1 * _Block_descriptor_1(struct Block_layout *aBlock)
-{
-    return aBlock->descriptor;
-}
+/**************************************************************************
+Locks and thread-specific data for the runtime's own caches
+***************************************************************************/
+
+#if __has_include(<os/lock.h>)
+#include <os/lock.h>
+// Zero-initialized storage is an unlocked lock.
+typedef os_unfair_lock block_lock_t;
+#define _Block_lock(l)   os_unfair_lock_lock(l)
+#define _Block_unlock(l) os_unfair_lock_unlock(l)
+#else
+typedef pthread_mutex_t block_lock_t;
+#define _Block_lock(l)   pthread_mutex_lock(l)
+#define _Block_unlock(l) pthread_mutex_unlock(l)
 #endif
 
-static struct Block_descriptor_2 * _Block_descriptor_2(struct Block_layout *aBlock)
-{
-    // 根据 BLOCK_HAS_COPY_DISPOSE 来判断是否有 Block_descriptor_2
-    if (! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE)) return NULL;
-    // 因为有无是编译器确定的，在Block结构体中并无保留，
-    // 所以需要使用 指针相加 的方式来确定其指针位置。有就执行，没有就 return NULL。
-    // 首先找到 descriptor 的位置，向后移动 sizeof(struct Block_descriptor_1) 的长度，
-    // 强转，看是否是 Block_descriptor_2 类型
-    uint8_t *desc = (uint8_t *)aBlock->descriptor;
-    desc += sizeof(struct Block_descriptor_1); // 指针移动
-    
-    return (struct Block_descriptor_2 *)desc;
-}
+// Per-thread caches live in dynamically created pthread keys.
+enum {
+    BLOCK_TSD_SLAB_CACHE = 0,   // struct block_slab_cache *
+    BLOCK_TSD_BYREF_CACHE,      // struct block_byref_cache *
+    BLOCK_TSD_ARENA,            // struct Block_arena *, innermost
+    BLOCK_TSD_COALLOC,          // struct block_coalloc_context *, innermost
+    BLOCK_TSD_BIAS,             // struct block_bias_thread *
+    BLOCK_TSD_DEFERRED,         // struct block_deferred_buffer *
+    BLOCK_TSD_MOVE,             // struct Block_layout * being moved, innermost
+    BLOCK_TSD_WORKER,           // struct block_worker * of a pool thread or guest
+    BLOCK_TSD_COUNT
+};
 
-static struct Block_descriptor_3 * _Block_descriptor_3(struct Block_layout *aBlock)
-{
-    // 根据 BLOCK_HAS_SIGNATURE 来判断是否有 Block_descriptor_3
-    // 处理完全同上
-    if (! (aBlock->flags & BLOCK_HAS_SIGNATURE)) return NULL;
-    
-    uint8_t *desc = (uint8_t *)aBlock->descriptor;
-    desc += sizeof(struct Block_descriptor_1);
-    
-    // 如果有 Block_descriptor_2,
-    // 则指针移动越过 Block_descriptor_2
-    if (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) {
-        desc += sizeof(struct Block_descriptor_2);
-    }
-    
-    return (struct Block_descriptor_3 *)desc;
+static pthread_key_t _Block_tsd_keys[BLOCK_TSD_COUNT];
+
+static inline void *_Block_tsd_get(int slot) {
+    return pthread_getspecific(_Block_tsd_keys[slot]);
 }
 
-static void _Block_call_copy_helper(void *result, struct Block_layout *aBlock)
-{
-    // 这里如果返回找到了 Block_descriptor_2，就执行它的 copy 函数，
-    // 如果没有找到就直接 return
-    // 这个 copy 函数，就是上面的 __main_block_copy_0 函数
-    struct Block_descriptor_2 *desc = _Block_descriptor_2(aBlock);
-    if (!desc) return;
+static inline void _Block_tsd_set(int slot, void *value) {
+    pthread_setspecific(_Block_tsd_keys[slot], value);
+}
 
-    (*desc->copy)(result, aBlock); // do fixup
+static void _Block_tsd_init(int slot, void (*destructor)(void *)) {
+    pthread_key_create(&_Block_tsd_keys[slot], destructor);
 }
 
-static void _Block_call_dispose_helper(struct Block_layout *aBlock)
-{
-    // 这里同上面
-    // 这里如果返回找到了 Block_descriptor_2，就执行它的 dispose 函数，
-    // 如果没有找到就直接 return
-    // 这个 dispose 函数，就是上面的 __main_block_copy_0 函数
-    struct Block_descriptor_2 *desc = _Block_descriptor_2(aBlock);
-    if (!desc) return;
+// Sets up the TSD slots and reads the allocator configuration.
+// Every entry point that allocates runs it through _Block_storage_once.
+static pthread_once_t _Block_storage_once = PTHREAD_ONCE_INIT;
+static void _Block_storage_init(void);
 
-    (*desc->dispose)(aBlock);
-}
+/**************************************************************************
+Refcount overflow
 
-/*******************************************************************************
-Internal Support routines for copying
-********************************************************************************/
+A refcount that outgrows the 15-bit inline field moves half of itself,
+BLOCK_REFCOUNT_SPILL, into a side table keyed by the address of the flags
+word, and the field is tagged BLOCK_REFCOUNT_OVERFLOW. The inline count
+then has room to move in both directions again; only a release that would
+otherwise deallocate looks at the tag and borrows the spilled count back.
+The table is split into lock stripes so unrelated hot blocks do not
+contend. The tag and the table entry for a field only change together,
+under that field's stripe lock.
+***************************************************************************/
 
-#if !TARGET_OS_WIN32
-#pragma mark Copy/Release support
-#endif
+#define BLOCK_REFCOUNT_SPILL       0x8000
+#define BLOCK_REFCOUNT_STRIPES     64
 
-// Copy, or bump refcount, of a block.  If really copying, call the copy helper if present.
-// 复制或增加块的引用计数。如果确实要复制，则调用 copy helper.（如果有）
-void *_Block_copy(const void *arg) {
-    // 1. 先声明一个Block_layout结构体类型的指针，如果传入的Block为NULL就直接返回。
-    struct Block_layout *aBlock;
+struct block_refcount_entry {
+    struct block_refcount_entry *next;
+    volatile int32_t *where;
+    size_t extra;               // in refcount field units
+};
 
-    if (!arg) return NULL;
-    
-    // The following would be better done as a switch statement
-    // 以下最好作为 Switch 语句来完成
-    
-    // 2. 如果Block有值就强转成Block_layout的指针类型。
-    aBlock = (struct Block_layout *)arg;
-    
-    // BLOCK_REFCOUNT_MASK 栈 block
-    // BLOCK_NEEDS_FREE 堆 block
-    // BLOCK_IS_GLOBAL 全局 block
-    // 3. 如果 Block 的 flags 表明该 Block 为堆 Block 时，
-    // 就对其引用计数递增，然后返回原 Block。
-    if (aBlock->flags & BLOCK_NEEDS_FREE) {
-        // ‼️‼️‼️ 这里表明，堆区 Block 执行 copy 操作，只是增加其引用。如果引用已经最大，则什么都不做。
-        // latches on high
-        latching_incr_int(&aBlock->flags);
-        return aBlock;
-    }
-    // 4. 如果Block为全局Block就不做其他处理直接返回。
-    else if (aBlock->flags & BLOCK_IS_GLOBAL) {
-        // ‼️‼️‼️ 这里表明，如果是全局 Block 执行 copy 操作，则直接返回自身
-        return aBlock;
-    }
-    else {
-        // Its a stack block. Make a copy.
-        // ‼️‼️‼️ 这里表明，如果是栈区 Block 执行 copy 操作，则把栈区 Block 复制到堆区
-        // 5. 该 else 中就是栈 Block了，
-        // 按原 Block 的内存大小分配一块相同大小的内存，
-        // 如果失败就返回NULL。
-        struct Block_layout *result =
-            (struct Block_layout *)malloc(aBlock->descriptor->size); // malloc 在堆区开辟空间
-        
-        if (!result) return NULL;
-        // 6. memmove() 用于复制位元，将 aBlock 的所有信息 copy 到 result 的位置上。
-        // memmove 函数，如果旧空间和新空间有交集，那么以新空间为主，复制完毕，旧空间会被破坏
-        
-        // 原型：void *memmove(void* dest, const void* src, size_t count );
-        // 头文件：<string.h>
-        // 功能：由 src 所指内存区域复制 count 个字节到 dest 所指内存区域。
-        // 相关函数：memset、memcpy
-        
-        memmove(result, aBlock, aBlock->descriptor->size); // bitcopy first
-        
-#if __has_feature(ptrauth_calls)
-        // Resign the invoke pointer as it uses address authentication.
-        result->invoke = aBlock->invoke;
-#endif
-        // reset refcount
-        
-        // BLOCK_DEALLOCATING =      (0x0001),
-        // BLOCK_REFCOUNT_MASK =     (0xfffe),
-        // 它们两者 ｜ 一下就是: 0xffff
-        
-        // 7. 将新Block的引用计数置零。
-        // BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING就是0xffff，
-        // ~(0xffff)就是0x0000，
-        // result->flags 与 0x0000 与等 就将 result->flags 的后 16 位置零。
-        // 然后将新 Block 标识为 堆Block 并将其引用计数置为 2。
-        // ｜2 表示把 后 16 位置为 0x0002，表示引用计数为 2
-        result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING); // XXX not needed
-        result->flags |= BLOCK_NEEDS_FREE | 2;  // logical refcount 1
-        
-        // 8. 如果有copy_dispose助手，就执行 Block 的保存的 copy 函数，
-        // 就是上面的 __main_block_copy_0。
-        // 在 _Block_descriptor_2 函数中，
-        // 用 BLOCK_HAS_COPY_DISPOSE 来判断是否有 Block_descriptor_2，
-        // 且取 Block 的Block_descriptor_2 时，
-        // 因为有无是编译器确定的，在 Block 结构体中并无保留，
-        // 所以需要使用指针相加的方式来确定其指针位置。
-        // 有就执行，没有就 return 。
-        _Block_call_copy_helper(result, aBlock);
-        // Set isa last so memory analysis tools see a fully-initialized object.
-        // 9. 将堆 Block 的isa指针置为 _NSConcreteMallocBlock，返回新Block，end。
-        // 这里 isa 被修正，我们用 clang 转换时显示为是栈区 Block 是不能确认的
-        // ‼️‼️‼️ 堆区 block
-        result->isa = _NSConcreteMallocBlock;
-        
-        return result;
-    }
+struct block_refcount_stripe {
+    block_lock_t lock;
+    struct block_refcount_entry *entries;
+} __attribute__((aligned(64)));
+
+static struct block_refcount_stripe _Block_refcount_stripes[BLOCK_REFCOUNT_STRIPES];
+
+static struct block_refcount_stripe *_Block_refcount_stripe(volatile int32_t *where) {
+    uintptr_t a = (uintptr_t)where;
+    return &_Block_refcount_stripes[((a >> 4) ^ (a >> 10)) % BLOCK_REFCOUNT_STRIPES];
 }
 
+static struct block_refcount_entry **
+_Block_refcount_find(struct block_refcount_stripe *stripe, volatile int32_t *where) {
+    struct block_refcount_entry **link = &stripe->entries;
+    while (*link && (*link)->where != where) link = &(*link)->next;
+    return link;
+}
 
-// Runtime entry points for maintaining the sharing knowledge of byref data blocks.
+// Inline count is full: move half of it to the side table and count the
+// caller's retain. Returns false if the field changed underneath us.
+static bool _Block_refcount_spill(volatile int32_t *where, int32_t old_value) {
+    struct block_refcount_stripe *stripe = _Block_refcount_stripe(where);
+    struct block_refcount_entry *fresh = NULL;
+    bool spilled = false;
 
-// A closure has been copied and its fixup routine is asking us to fix up the reference to the shared byref data
-// Closures that aren't copied must still work, so everyone always accesses variables after dereferencing the forwarding ptr.
-// We ask if the byref pointer that we know about has already been copied to the heap, and if so, increment and return it.
-// Otherwise we need to copy it and update the stack forwarding pointer
-static struct Block_byref *_Block_byref_copy(const void *arg) {
-    // 3.1 强制转换入参为(struct Block_byref *)类型。
-    struct Block_byref *src = (struct Block_byref *)arg;
+    _Block_lock(&stripe->lock);
+    struct block_refcount_entry *entry = *_Block_refcount_find(stripe, where);
+    if (!entry) {
+        fresh = entry = (struct block_refcount_entry *)malloc(sizeof(*entry));
+        os_assert(entry);
+        entry->next = stripe->entries;
+        entry->where = where;
+        entry->extra = 0;
+    }
+    int32_t new_value = (old_value - BLOCK_REFCOUNT_SPILL + 2) | BLOCK_REFCOUNT_OVERFLOW;
+    if (_Block_atomic_int(where)->compare_exchange_strong(old_value, new_value,
+                                                            std::memory_order_relaxed)) {
+        entry->extra += BLOCK_REFCOUNT_SPILL;
+        if (fresh) stripe->entries = fresh;
+        fresh = NULL;
+        spilled = true;
+    }
+    _Block_unlock(&stripe->lock);
 
-    // 当入参为栈 byref 时执行此步，
-    // 表示先是栈 Block 有 __block 变量，
-    // 此时处于把栈 block 复制到堆中，
-    // 此时的操作是把这个 __block 变量复制到堆中去
-    if ((src->forwarding->flags & BLOCK_REFCOUNT_MASK) == 0) {
-        // src points to stack
-        // 3.2 当入参为栈 byref 时执行此步。
-        // 分配一份与当前 byref 相同的内存，并将 isa 指针置为 NULL。
-        struct Block_byref *copy = (struct Block_byref *)malloc(src->size); // __Block_byref_val_0 这种结构体实例
-        copy->isa = NULL;
-        
-        // byref value 4 is logical refcount of 2: one for caller, one for stack
-        // 3.3 将新 byref 的引用计数置为 4 并标记为堆，一份为调用方、一份为栈持有，所以引用计数为4。
-        copy->flags = src->flags | BLOCK_BYREF_NEEDS_FREE | 4;
-        
-        // 3.4 然后将当前 byref 和 malloc 的 byref 的 forwading 都指向 堆byref，然后操作堆栈都是同一份东西。
-        // 这两行特关键：
-        // ‼️‼️‼️ 正印证那一句，copy 发生后栈区 Block 的 __block 变量的 __forwarding 指向堆中的 __block 变量
-        // 堆中的 __block 的 __forwarding 指向自己
-        copy->forwarding = copy; // patch heap copy to point to itself
-        src->forwarding = copy;  // patch stack to point to heap copy
-        
-        // 3.5 最后将size赋值
-        copy->size = src->size;
+    if (fresh) free(fresh);
+    return spilled;
+}
 
-        if (src->flags & BLOCK_BYREF_HAS_COPY_DISPOSE) {
-            // Trust copy helper to copy everything of interest
-            // If more than one field shows up in a byref block this is wrong XXX
-            // 3.6 如果 src(入参) byref 含有内存管理的变量即有 copy_dispose 助手，执行此步。
-            // 分别取出 src 的 Block_byref_2 和 copy 的 Block_byref_2。
-            struct Block_byref_2 *src2 = (struct Block_byref_2 *)(src+1);
-            struct Block_byref_2 *copy2 = (struct Block_byref_2 *)(copy+1);
-            // 3.7 将 src 的管理内存函数指针赋值给 copy。
-            copy2->byref_keep = src2->byref_keep;
-            copy2->byref_destroy = src2->byref_destroy;
+// Releasing the last inline reference of a field tagged
+// BLOCK_REFCOUNT_OVERFLOW: borrow the spilled count back, dropping the tag
+// once the table has nothing left for it. Returns false if the field
+// changed underneath us.
+static bool _Block_refcount_unspill(volatile int32_t *where, int32_t old_value) {
+    struct block_refcount_stripe *stripe = _Block_refcount_stripe(where);
+    bool borrowed = false;
 
-            if (src->flags & BLOCK_BYREF_LAYOUT_EXTENDED) {
-                // 3.8 如果 src 含有 Block_byref_3，则将 src 的 Block_byref_3 赋值给 copy
-                struct Block_byref_3 *src3 = (struct Block_byref_3 *)(src2+1);
-                struct Block_byref_3 *copy3 = (struct Block_byref_3*)(copy2+1);
-                
-                copy3->layout = src3->layout;
-            }
-            
-            // 3.9 执行 byref 的 byref_keep 函数(即 _Block_object_assign，不过会加上 BLOCK_BYREF_CALLER 标记)，管理捕获的对象内存。
-            (*src2->byref_keep)(copy, src);
-        }
-        else {
-            // Bitwise copy.
-            // This copy includes Block_byref_3, if any.
-            // 3.10 如果捕获的是普通变量，就没有 Block_byref_2，copy+1 和src+1 指向的就是 Block_byref_3，执行字节拷贝。
-            memmove(copy+1, src+1, src->size - sizeof(*src));
+    _Block_lock(&stripe->lock);
+    struct block_refcount_entry **link = _Block_refcount_find(stripe, where);
+    struct block_refcount_entry *entry = *link;
+    os_assert(entry && entry->extra);
+    size_t take = entry->extra < BLOCK_REFCOUNT_SPILL ? entry->extra : BLOCK_REFCOUNT_SPILL;
+    int32_t new_value = old_value - 2 + (int32_t)take;
+    if (take == entry->extra) new_value &= ~BLOCK_REFCOUNT_OVERFLOW;
+    if (_Block_atomic_int(where)->compare_exchange_strong(old_value, new_value,
+                                                            std::memory_order_relaxed)) {
+        entry->extra -= take;
+        if (entry->extra == 0) {
+            *link = entry->next;
+        } else {
+            entry = NULL;
         }
+        borrowed = true;
+    } else {
+        entry = NULL;
     }
-    // already copied to heap
-    else if ((src->forwarding->flags & BLOCK_BYREF_NEEDS_FREE) == BLOCK_BYREF_NEEDS_FREE) {
-        // 3.11 如果该 byref 是存在于堆，则只需要增加其引用计数。
-        latching_incr_int(&src->forwarding->flags);
-    }
-    
-    // 3.12 返回forwarding。
-    return src->forwarding;
+    _Block_unlock(&stripe->lock);
+
+    if (entry) free(entry);
+    return borrowed;
 }
 
-static void _Block_byref_release(const void *arg) {
-    // 1.1 将入参强转成(struct Block_byref *)，并将入参替换成 forwarding 。（指向堆中的 __block 变量）
-    struct Block_byref *byref = (struct Block_byref *)arg;
+/**************************************************************************
+Heap storage for blocks
 
-    // dereference the forwarding pointer since the compiler isn't doing this anymore (ever?)
+Stack-to-heap promotions in _Block_copy allocate through _Block_alloc_block
+and the final _Block_release hands the memory back to _Block_free_block.
+By default these are malloc and free.
+
+Setting LIBCLOSURE_SLAB_ALLOCATOR=YES in the environment selects a
+size-class slab allocator instead. The choice is made once, before the
+first heap copy, and never changes afterwards, so the allocator that owns
+a block is always the current one. Size classes are tuned to the typical
+descriptor->size of small completion blocks; larger blocks still go to
+malloc. Every thread keeps a magazine of free objects per size class and
+exchanges half-magazines with a locked per-class depot, so steady-state
+copy/release traffic never touches a shared lock. Slab memory is recycled
+but never returned to the system.
+***************************************************************************/
+
+#define BLOCK_SLAB_QUANTUM        16
+#define BLOCK_SLAB_MAX_SIZE       256
+#define BLOCK_SLAB_CHUNK_SIZE     (64 * 1024)
+#define BLOCK_SLAB_MAGAZINE_SIZE  32
+
+static const uint16_t _Block_slab_class_sizes[] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 256
+};
+
+#define BLOCK_SLAB_CLASS_COUNT \
+    (sizeof(_Block_slab_class_sizes) / sizeof(_Block_slab_class_sizes[0]))
+
+// Maps (size + 15) / 16 to an index in _Block_slab_class_sizes.
+static const uint8_t _Block_slab_class_for_quantum[BLOCK_SLAB_MAX_SIZE / BLOCK_SLAB_QUANTUM + 1] = {
+    0, 0, 0,        // 0..32
+    1,              // 48
+    2,              // 64
+    3,              // 80
+    4,              // 96
+    5,              // 112
+    6,              // 128
+    7, 7,           // 144..160
+    8, 8,           // 176..192
+    9, 9, 9, 9,     // 208..256
+};
+
+struct block_slab_free {
+    struct block_slab_free *next;
+};
+
+struct block_slab_depot {
+    block_lock_t lock;
+    struct block_slab_free *head;
+};
+
+struct block_slab_magazine {
+    uint32_t count;
+    void *objects[BLOCK_SLAB_MAGAZINE_SIZE];
+};
+
+struct block_slab_cache {
+    struct block_slab_magazine magazines[BLOCK_SLAB_CLASS_COUNT];
+};
+
+static struct block_slab_depot _Block_slab_depots[BLOCK_SLAB_CLASS_COUNT];
+
+static inline unsigned _Block_slab_class(size_t size) {
+    return _Block_slab_class_for_quantum[(size + BLOCK_SLAB_QUANTUM - 1) / BLOCK_SLAB_QUANTUM];
+}
+
+// Move up to `want` objects from the depot into the magazine, carving a
+// fresh chunk if the depot is empty. Call with the depot unlocked.
+static void _Block_slab_refill(unsigned cls, struct block_slab_magazine *mag, uint32_t want) {
+    struct block_slab_depot *depot = &_Block_slab_depots[cls];
+
+    _Block_lock(&depot->lock);
+    if (!depot->head) {
+        size_t size = _Block_slab_class_sizes[cls];
+        char *chunk = (char *)malloc(BLOCK_SLAB_CHUNK_SIZE);
+        if (chunk) {
+            // Thread the chunk back-to-front so objects come out in address order.
+            for (size_t offset = (BLOCK_SLAB_CHUNK_SIZE / size) * size; offset != 0; ) {
+                offset -= size;
+                struct block_slab_free *obj = (struct block_slab_free *)(chunk + offset);
+                obj->next = depot->head;
+                depot->head = obj;
+            }
+        }
+    }
+    while (want-- && depot->head) {
+        struct block_slab_free *obj = depot->head;
+        depot->head = obj->next;
+        mag->objects[mag->count++] = obj;
+    }
+    _Block_unlock(&depot->lock);
+}
+
+// Move the top `count` objects of the magazine back to the depot.
+static void _Block_slab_drain(unsigned cls, struct block_slab_magazine *mag, uint32_t count) {
+    struct block_slab_depot *depot = &_Block_slab_depots[cls];
+    struct block_slab_free *head = NULL, *tail = NULL;
+
+    while (count-- && mag->count) {
+        struct block_slab_free *obj = (struct block_slab_free *)mag->objects[--mag->count];
+        obj->next = head;
+        head = obj;
+        if (!tail) tail = obj;
+    }
+    if (!head) return;
+
+    _Block_lock(&depot->lock);
+    tail->next = depot->head;
+    depot->head = head;
+    _Block_unlock(&depot->lock);
+}
+
+// Thread exit: give every cached object back to the depots.
+static void _Block_slab_cache_destroy(void *arg) {
+    struct block_slab_cache *cache = (struct block_slab_cache *)arg;
+    for (unsigned cls = 0; cls < BLOCK_SLAB_CLASS_COUNT; cls++) {
+        _Block_slab_drain(cls, &cache->magazines[cls], BLOCK_SLAB_MAGAZINE_SIZE);
+    }
+    free(cache);
+}
+
+static struct block_slab_cache *_Block_slab_cache(void) {
+    struct block_slab_cache *cache =
+        (struct block_slab_cache *)_Block_tsd_get(BLOCK_TSD_SLAB_CACHE);
+    if (os_slowpath(!cache)) {
+        cache = (struct block_slab_cache *)calloc(1, sizeof(*cache));
+        if (cache) _Block_tsd_set(BLOCK_TSD_SLAB_CACHE, cache);
+    }
+    return cache;
+}
+
+// Falls back to malloc when no cache or chunk can be had. The object is
+// allocated at its class size, so it can join the slab when it is freed.
+static void *_Block_slab_alloc(size_t size) {
+    unsigned cls = _Block_slab_class(size);
+    struct block_slab_cache *cache = _Block_slab_cache();
+    if (os_slowpath(!cache)) return malloc(_Block_slab_class_sizes[cls]);
+
+    struct block_slab_magazine *mag = &cache->magazines[cls];
+    if (os_slowpath(mag->count == 0)) {
+        _Block_slab_refill(cls, mag, BLOCK_SLAB_MAGAZINE_SIZE / 2);
+        if (mag->count == 0) return malloc(_Block_slab_class_sizes[cls]);
+    }
+    return mag->objects[--mag->count];
+}
+
+static void _Block_slab_free(void *ptr, size_t size) {
+    unsigned cls = _Block_slab_class(size);
+    struct block_slab_cache *cache = _Block_slab_cache();
+    if (os_slowpath(!cache)) {
+        struct block_slab_depot *depot = &_Block_slab_depots[cls];
+        struct block_slab_free *obj = (struct block_slab_free *)ptr;
+        _Block_lock(&depot->lock);
+        obj->next = depot->head;
+        depot->head = obj;
+        _Block_unlock(&depot->lock);
+        return;
+    }
+
+    struct block_slab_magazine *mag = &cache->magazines[cls];
+    if (os_slowpath(mag->count == BLOCK_SLAB_MAGAZINE_SIZE)) {
+        _Block_slab_drain(cls, mag, BLOCK_SLAB_MAGAZINE_SIZE / 2);
+    }
+    mag->objects[mag->count++] = ptr;
+}
+
+/**************************************************************************
+Heap storage for __block variables
+
+__block variables are promoted by _Block_byref_copy and die in
+_Block_byref_release, usually within the same request on the same thread.
+Each thread keeps a small magazine of freed byrefs per size class,
+separate from block storage, so that the common promote/release cycle
+never reaches malloc. A full magazine passes frees through to the general
+allocator, and a thread's magazines are emptied when it exits.
+
+The magazines hang off an ordinary pthread key, so finding them costs a
+pthread_getspecific. A direct TSD slot would be a single load, but
+libpthread reserves none of its static keys for libclosure.
+***************************************************************************/
+
+#define BLOCK_BYREF_MAGAZINE_SIZE  16
+
+// sizeof(struct Block_byref) plus a scalar, an object with copy/dispose
+// helpers, and small structs.
+static const uint16_t _Block_byref_class_sizes[] = { 48, 64, 96, 128 };
+
+#define BLOCK_BYREF_CLASS_COUNT \
+    (sizeof(_Block_byref_class_sizes) / sizeof(_Block_byref_class_sizes[0]))
+#define BLOCK_BYREF_MAX_SIZE \
+    (_Block_byref_class_sizes[BLOCK_BYREF_CLASS_COUNT - 1])
+
+struct block_byref_magazine {
+    uint32_t count;
+    void *objects[BLOCK_BYREF_MAGAZINE_SIZE];
+};
+
+struct block_byref_cache {
+    struct block_byref_magazine magazines[BLOCK_BYREF_CLASS_COUNT];
+};
+
+static inline unsigned _Block_byref_class(size_t size) {
+    unsigned cls = 0;
+    while (_Block_byref_class_sizes[cls] < size) cls++;
+    return cls;
+}
+
+// Thread exit: hand every cached byref back to the general allocator.
+static void _Block_byref_cache_destroy(void *arg) {
+    struct block_byref_cache *cache = (struct block_byref_cache *)arg;
+    for (unsigned cls = 0; cls < BLOCK_BYREF_CLASS_COUNT; cls++) {
+        struct block_byref_magazine *mag = &cache->magazines[cls];
+        while (mag->count) free(mag->objects[--mag->count]);
+    }
+    free(cache);
+}
+
+static struct block_byref_cache *_Block_byref_cache(void) {
+    struct block_byref_cache *cache =
+        (struct block_byref_cache *)_Block_tsd_get(BLOCK_TSD_BYREF_CACHE);
+    if (os_slowpath(!cache)) {
+        cache = (struct block_byref_cache *)calloc(1, sizeof(*cache));
+        if (cache) _Block_tsd_set(BLOCK_TSD_BYREF_CACHE, cache);
+    }
+    return cache;
+}
+
+/**************************************************************************
+Block arenas
+
+Between Block_arena_push and the matching Block_arena_pop, heap copies of
+blocks and __block variables made on the pushing thread are bump-allocated
+from the innermost arena and tagged BLOCK_IN_ARENA / BLOCK_BYREF_IN_ARENA.
+Releasing them still runs their dispose helpers, but only decrements a
+live count in the owning chunk instead of freeing.
+
+Chunks are aligned to their size so an object finds its chunk by masking
+its address. Popping the arena frees every chunk whose objects are all
+dead. Chunks that still hold live objects have escaped the scope; they
+are orphaned and freed by whichever release kills their last object, so
+an escaping block keeps ordinary heap lifetime. Block_arena_pop reports
+how many objects escaped.
+***************************************************************************/
+
+#define BLOCK_ARENA_CHUNK_SIZE  (64 * 1024)
+#define BLOCK_ARENA_ALIGNMENT   16
+
+// In block_arena_chunk.live once the owning arena has been popped.
+#define BLOCK_ARENA_ORPHANED    0x80000000u
+
+struct block_arena_chunk {
+    struct block_arena_chunk *next;
+    volatile uint32_t live;     // live objects, | BLOCK_ARENA_ORPHANED
+    char *cursor;
+    char *end;
+};
+
+struct Block_arena {
+    struct Block_arena *parent;
+    struct block_arena_chunk *chunks;   // newest first
+};
+
+#define BLOCK_ARENA_HEADER_SIZE \
+    ((sizeof(struct block_arena_chunk) + BLOCK_ARENA_ALIGNMENT - 1) & ~(size_t)(BLOCK_ARENA_ALIGNMENT - 1))
+
+static inline struct block_arena_chunk *_Block_arena_chunk_for(void *ptr) {
+    return (struct block_arena_chunk *)((uintptr_t)ptr & ~(uintptr_t)(BLOCK_ARENA_CHUNK_SIZE - 1));
+}
+
+// Set by the first Block_arena_push. Until then no thread can have an
+// arena, and copies skip the TSD lookup.
+static bool _Block_arena_pushed;
+
+// The calling thread's innermost arena, or NULL.
+static inline struct Block_arena *_Block_arena_current(void) {
+    if (os_fastpath(!__atomic_load_n(&_Block_arena_pushed, __ATOMIC_RELAXED))) return NULL;
+    return (struct Block_arena *)_Block_tsd_get(BLOCK_TSD_ARENA);
+}
+
+// Returns NULL if no arena is active or the arena cannot satisfy `size`;
+// the caller then uses ordinary storage.
+static void *_Block_arena_alloc(size_t size) {
+    struct Block_arena *arena = _Block_arena_current();
+    if (os_fastpath(!arena)) return NULL;
+
+    size = (size + BLOCK_ARENA_ALIGNMENT - 1) & ~(size_t)(BLOCK_ARENA_ALIGNMENT - 1);
+    if (size > BLOCK_ARENA_CHUNK_SIZE - BLOCK_ARENA_HEADER_SIZE) return NULL;
+
+    struct block_arena_chunk *chunk = arena->chunks;
+    if (!chunk || (size_t)(chunk->end - chunk->cursor) < size) {
+        void *mem;
+        if (posix_memalign(&mem, BLOCK_ARENA_CHUNK_SIZE, BLOCK_ARENA_CHUNK_SIZE) != 0) {
+            return NULL;
+        }
+        chunk = (struct block_arena_chunk *)mem;
+        chunk->next = arena->chunks;
+        chunk->live = 0;
+        chunk->cursor = (char *)mem + BLOCK_ARENA_HEADER_SIZE;
+        chunk->end = (char *)mem + BLOCK_ARENA_CHUNK_SIZE;
+        arena->chunks = chunk;
+    }
+
+    void *result = chunk->cursor;
+    chunk->cursor += size;
+    __sync_fetch_and_add(&chunk->live, 1);
+    return result;
+}
+
+static void _Block_arena_free(void *ptr) {
+    struct block_arena_chunk *chunk = _Block_arena_chunk_for(ptr);
+    if (__sync_fetch_and_sub(&chunk->live, 1) == (BLOCK_ARENA_ORPHANED | 1)) {
+        free(chunk);
+    }
+}
+
+Block_arena_t Block_arena_push(void) {
+    pthread_once(&_Block_storage_once, _Block_storage_init);
+
+    struct Block_arena *arena = (struct Block_arena *)malloc(sizeof(*arena));
+    if (!arena) return NULL;
+    arena->parent = (struct Block_arena *)_Block_tsd_get(BLOCK_TSD_ARENA);
+    arena->chunks = NULL;
+    // Only this thread reads its own slot, so no ordering is needed.
+    __atomic_store_n(&_Block_arena_pushed, true, __ATOMIC_RELAXED);
+    _Block_tsd_set(BLOCK_TSD_ARENA, arena);
+    return arena;
+}
+
+size_t Block_arena_pop(Block_arena_t arena) {
+    if (!arena) return 0;
+    // Arenas nest; popping out of order is a programming error.
+    os_assert(arena == _Block_tsd_get(BLOCK_TSD_ARENA));
+    _Block_tsd_set(BLOCK_TSD_ARENA, arena->parent);
+
+    size_t escaped = 0;
+    struct block_arena_chunk *chunk = arena->chunks;
+    while (chunk) {
+        struct block_arena_chunk *next = chunk->next;
+        uint32_t live = __sync_fetch_and_or(&chunk->live, BLOCK_ARENA_ORPHANED);
+        if (live == 0) free(chunk);
+        else escaped += live;
+        chunk = next;
+    }
+    free(arena);
+    return escaped;
+}
+
+// Thread exit: pop any arenas the thread left open.
+static void _Block_arena_destroy(void *arg) {
+    struct Block_arena *arena = (struct Block_arena *)arg;
+    _Block_tsd_set(BLOCK_TSD_ARENA, arena);
+    while (arena) {
+        struct Block_arena *parent = arena->parent;
+        Block_arena_pop(arena);
+        arena = parent;
+    }
+}
+
+/**************************************************************************
+Storage entry points
+***************************************************************************/
+
+static bool _Block_use_slab;
+static bool _Block_use_bias;
+static bool _Block_collect_stats;
+static bool _Block_storage_initialized;
+
+// Set by _Block_use_alloc. When present it backs every heap copy of a block
+// or __block variable outside an arena, replacing malloc, the slab allocator
+// and the byref magazines.
+static bool _Block_use_external_allocator;
+static Block_callbacks_alloc _Block_external_allocator;
+
+static bool _Block_env_enabled(const char *name) {
+    const char *env = getenv(name);
+    return env && (0 == strcmp(env, "YES") || 0 == strcmp(env, "1"));
+}
+
+static void _Block_bias_thread_exit(void *arg);
+static void _Block_deferred_thread_exit(void *arg);
+
+static void _Block_storage_init(void) {
+    _Block_tsd_init(BLOCK_TSD_SLAB_CACHE, _Block_slab_cache_destroy);
+    _Block_tsd_init(BLOCK_TSD_BYREF_CACHE, _Block_byref_cache_destroy);
+    _Block_tsd_init(BLOCK_TSD_ARENA, _Block_arena_destroy);
+    _Block_tsd_init(BLOCK_TSD_COALLOC, NULL);
+    _Block_tsd_init(BLOCK_TSD_BIAS, _Block_bias_thread_exit);
+    _Block_tsd_init(BLOCK_TSD_DEFERRED, _Block_deferred_thread_exit);
+    _Block_tsd_init(BLOCK_TSD_MOVE, NULL);
+    _Block_tsd_init(BLOCK_TSD_WORKER, NULL);
+
+    _Block_use_slab = !_Block_use_external_allocator &&
+        _Block_env_enabled("LIBCLOSURE_SLAB_ALLOCATOR");
+    _Block_use_bias = _Block_env_enabled("LIBCLOSURE_BIASED_REFCOUNT");
+    _Block_collect_stats = _Block_env_enabled("LIBCLOSURE_BLOCK_STATS");
+
+    _Block_storage_initialized = true;
+}
+
+void _Block_use_alloc(const Block_callbacks_alloc *callbacks) {
+    // Memory already handed out must go back to the allocator that made it,
+    // so the allocator can only be chosen before the first heap copy.
+    os_assert(!_Block_storage_initialized);
+
+    // Older clients pass a shorter struct; missing fields stay NULL.
+    size_t size = callbacks->size;
+    if (size > sizeof(_Block_external_allocator)) size = sizeof(_Block_external_allocator);
+    memset(&_Block_external_allocator, 0, sizeof(_Block_external_allocator));
+    memcpy(&_Block_external_allocator, callbacks, size);
+    _Block_external_allocator.size = sizeof(_Block_external_allocator);
+
+    os_assert(_Block_external_allocator.alloc);
+    os_assert(_Block_external_allocator.free || _Block_external_allocator.free_sized);
+    _Block_use_external_allocator = true;
+}
+
+static inline void _Block_external_free(void *ptr, size_t size) {
+    if (_Block_external_allocator.free_sized) {
+        _Block_external_allocator.free_sized(ptr, size);
+    } else {
+        _Block_external_allocator.free(ptr);
+    }
+}
+
+// Allocate a heap copy of a block. *storage receives runtime flag bits
+// describing where the memory came from, to be or'ed into the copy's flags.
+static void *_Block_alloc_block(size_t size, int32_t *storage) {
+    pthread_once(&_Block_storage_once, _Block_storage_init);
+
+    void *result = _Block_arena_alloc(size);
+    if (result) {
+        *storage = BLOCK_IN_ARENA;
+        return result;
+    }
+
+    *storage = 0;
+    if (os_slowpath(_Block_use_external_allocator)) {
+        return _Block_external_allocator.alloc(size);
+    }
+    if (_Block_use_slab && size <= BLOCK_SLAB_MAX_SIZE) {
+        return _Block_slab_alloc(size);
+    }
+    return malloc(size);
+}
+
+static void _Block_coalloc_release(void *ptr);
+
+// `size` must be the size that was passed to _Block_alloc_block.
+static void _Block_free_block(void *ptr, size_t size, int32_t flags) {
+    if (flags & BLOCK_COALLOCATED) {
+        _Block_coalloc_release(ptr);
+        return;
+    }
+    if (flags & BLOCK_IN_ARENA) {
+        _Block_arena_free(ptr);
+        return;
+    }
+    if (os_slowpath(_Block_use_external_allocator)) {
+        _Block_external_free(ptr, size);
+        return;
+    }
+    if (_Block_use_slab && size <= BLOCK_SLAB_MAX_SIZE) {
+        _Block_slab_free(ptr, size);
+        return;
+    }
+    free(ptr);
+}
+
+// Allocate a heap copy of a __block variable. *storage is as for
+// _Block_alloc_block, using the BLOCK_BYREF_* flag bits.
+static void *_Block_alloc_byref(size_t size, int32_t *storage) {
+    pthread_once(&_Block_storage_once, _Block_storage_init);
+
+    void *result = _Block_arena_alloc(size);
+    if (result) {
+        *storage = BLOCK_BYREF_IN_ARENA;
+        return result;
+    }
+
+    *storage = 0;
+    if (os_slowpath(_Block_use_external_allocator)) {
+        return _Block_external_allocator.alloc(size);
+    }
+    if (size > BLOCK_BYREF_MAX_SIZE) return malloc(size);
+
+    unsigned cls = _Block_byref_class(size);
+    struct block_byref_cache *cache = _Block_byref_cache();
+    if (cache && cache->magazines[cls].count) {
+        struct block_byref_magazine *mag = &cache->magazines[cls];
+        return mag->objects[--mag->count];
+    }
+    return malloc(_Block_byref_class_sizes[cls]);
+}
+
+// `size` must be the size that was passed to _Block_alloc_byref.
+static void _Block_free_byref(void *ptr, size_t size, int32_t flags) {
+    if (flags & BLOCK_BYREF_COALLOCATED) {
+        _Block_coalloc_release(ptr);
+        return;
+    }
+    if (flags & BLOCK_BYREF_IN_ARENA) {
+        _Block_arena_free(ptr);
+        return;
+    }
+    if (os_slowpath(_Block_use_external_allocator)) {
+        _Block_external_free(ptr, size);
+        return;
+    }
+    if (size > BLOCK_BYREF_MAX_SIZE) {
+        free(ptr);
+        return;
+    }
+
+    unsigned cls = _Block_byref_class(size);
+    struct block_byref_cache *cache = _Block_byref_cache();
+    if (cache && cache->magazines[cls].count < BLOCK_BYREF_MAGAZINE_SIZE) {
+        struct block_byref_magazine *mag = &cache->magazines[cls];
+        mag->objects[mag->count++] = ptr;
+        return;
+    }
+    free(ptr);
+}
+
+/**************************************************************************
+Co-allocated blocks and __block variables
+
+When _Block_copy promotes a stack block together with __block variables
+that no one has promoted yet, it makes a single allocation for all of them:
+
+    [chunk header][tag][block][tag][byref] ... [tag][byref]
+
+Every object is preceded by a tag pointing back at the chunk header, which
+counts the objects still alive. The block and its byrefs keep their own
+reference counts and are disposed independently, tagged BLOCK_COALLOCATED
+and BLOCK_BYREF_COALLOCATED; the chunk is freed along with the last of
+them. _Block_coalloc_begin decides what to reserve and _Block_byref_copy
+claims the reserved space through the context published in
+BLOCK_TSD_COALLOC while the block's copy helper runs.
+***************************************************************************/
+
+#define BLOCK_COALLOC_ALIGNMENT   16
+#define BLOCK_COALLOC_MAX_BYREFS  16
+
+#define BLOCK_COALLOC_ROUND(n) \
+    (((n) + BLOCK_COALLOC_ALIGNMENT - 1) & ~(size_t)(BLOCK_COALLOC_ALIGNMENT - 1))
+
+struct block_coalloc_chunk {
+    volatile int32_t live;
+    uint32_t size;      // as passed to _Block_alloc_block
+};
+
+struct block_coalloc_tag {
+    struct block_coalloc_chunk *chunk;
+};
+
+#define BLOCK_COALLOC_HEADER_SIZE BLOCK_COALLOC_ROUND(sizeof(struct block_coalloc_chunk))
+#define BLOCK_COALLOC_TAG_SIZE    BLOCK_COALLOC_ROUND(sizeof(struct block_coalloc_tag))
+
+struct block_coalloc_context {
+    struct block_coalloc_context *previous;
+    struct block_coalloc_chunk *chunk;
+    int count;
+    int claimed;
+    struct Block_byref *sources[BLOCK_COALLOC_MAX_BYREFS];
+    void *slots[BLOCK_COALLOC_MAX_BYREFS];      // NULL once claimed
+};
+
+// Place an object at `offset` in the chunk and tag it.
+static void *_Block_coalloc_place(struct block_coalloc_chunk *chunk, size_t offset) {
+    char *object = (char *)chunk + offset + BLOCK_COALLOC_TAG_SIZE;
+    ((struct block_coalloc_tag *)(object - BLOCK_COALLOC_TAG_SIZE))->chunk = chunk;
+    return object;
+}
+
+static void _Block_coalloc_release(void *ptr) {
+    struct block_coalloc_tag *tag =
+        (struct block_coalloc_tag *)((char *)ptr - BLOCK_COALLOC_TAG_SIZE);
+    struct block_coalloc_chunk *chunk = tag->chunk;
+    if (__sync_sub_and_fetch(&chunk->live, 1) == 0) {
+        _Block_free_block(chunk, chunk->size, 0);
+    }
+}
+
+// Called by _Block_byref_copy for a stack byref it is about to promote.
+// Returns reserved space for it, or NULL.
+static struct Block_byref *_Block_coalloc_claim_byref(struct Block_byref *src) {
+    if (!_Block_storage_initialized) return NULL;
+    struct block_coalloc_context *ctx =
+        (struct block_coalloc_context *)_Block_tsd_get(BLOCK_TSD_COALLOC);
+    if (os_fastpath(!ctx)) return NULL;
+
+    for (int i = 0; i < ctx->count; i++) {
+        if (ctx->sources[i] == src && ctx->slots[i]) {
+            void *slot = ctx->slots[i];
+            ctx->slots[i] = NULL;
+            ctx->claimed++;
+            return (struct Block_byref *)slot;
+        }
+    }
+    return NULL;
+}
+
+/**************************************************************************
+Biased refcounts
+
+With LIBCLOSURE_BIASED_REFCOUNT=YES in the environment, heap copies made by
+_Block_copy are biased to the copying thread and tagged BLOCK_BIASED.
+A header in front of the block holds two counts: `biased`, which only the
+owning thread touches, with plain loads and stores, and `shared`, which
+every other thread updates atomically. The refcount in the block's flags
+stays at 1 and is not used.
+
+The block is alive while biased + shared > 0. Releases by other threads
+may drive `shared` negative; the first time that happens the block is
+queued on its owner, which merges the two counts and gives up ownership
+at its next release or when it exits. When the owner's own count drops to
+zero it merges on the spot. A merged block is refcounted through `shared`
+alone and deallocated by whichever release takes it to zero, unless it is
+still queued, in which case the owner's merge pass deallocates it.
+
+Thread records are never freed, because blocks may outlive their owner
+and still name it. Threads beyond BLOCK_BIAS_MAX_THREADS copy blocks that
+start out merged. Co-allocated blocks are never biased.
+***************************************************************************/
+
+#define BLOCK_BIAS_MAX_THREADS  16384
+
+// `shared` holds the count in BLOCK_BIAS_ONE units plus two state bits.
+#define BLOCK_BIAS_MERGED       0x1
+#define BLOCK_BIAS_QUEUED       0x2
+#define BLOCK_BIAS_ONE          0x4
+
+struct block_bias_header {
+    struct block_bias_header *next;     // owner's merge queue
+    uint32_t owner;                     // id of the copying thread, or 0
+    int32_t biased;                     // owner only, 0 once merged
+    std::atomic<int32_t> shared;
+};
+
+#define BLOCK_BIAS_HEADER_SIZE BLOCK_COALLOC_ROUND(sizeof(struct block_bias_header))
+
+struct block_bias_thread {
+    block_lock_t lock;
+    uint32_t id;
+    bool dead;
+    std::atomic<bool> pending;          // queue is not empty
+    struct block_bias_header *queue;
+};
+
+static struct block_bias_thread *_Block_bias_threads[BLOCK_BIAS_MAX_THREADS];
+static std::atomic<uint32_t> _Block_bias_next_id(1);
+
+static void _Block_deallocate(struct Block_layout *aBlock);
+
+static inline struct block_bias_header *_Block_bias_header(struct Block_layout *aBlock) {
+    return (struct block_bias_header *)((char *)aBlock - BLOCK_BIAS_HEADER_SIZE);
+}
+
+static inline struct Block_layout *_Block_bias_block(struct block_bias_header *header) {
+    return (struct Block_layout *)((char *)header + BLOCK_BIAS_HEADER_SIZE);
+}
+
+// The calling thread's record, or NULL if it owns no blocks.
+static inline struct block_bias_thread *_Block_bias_self(void) {
+    return (struct block_bias_thread *)_Block_tsd_get(BLOCK_TSD_BIAS);
+}
+
+static struct block_bias_thread *_Block_bias_self_create(void) {
+    struct block_bias_thread *self = _Block_bias_self();
+    if (self) return self;
+
+    uint32_t id = _Block_bias_next_id.fetch_add(1, std::memory_order_relaxed);
+    if (id >= BLOCK_BIAS_MAX_THREADS) return NULL;
+    self = (struct block_bias_thread *)calloc(1, sizeof(*self));
+    if (!self) return NULL;
+#if !__has_include(<os/lock.h>)
+    pthread_mutex_init(&self->lock, NULL);
+#endif
+    self->id = id;
+    _Block_bias_threads[id] = self;
+    _Block_tsd_set(BLOCK_TSD_BIAS, self);
+    return self;
+}
+
+// Fold the owner's count into `shared` and give up ownership. Only the
+// owner may do this, or anyone once the owner has exited. Returns true if
+// the block should be deallocated.
+static bool _Block_bias_merge(struct block_bias_header *header) {
+    int32_t biased = header->biased;
+    header->biased = 0;
+
+    int32_t old_value = header->shared.load(std::memory_order_relaxed);
+    int32_t new_value;
+    do {
+        new_value = ((old_value + biased * BLOCK_BIAS_ONE) | BLOCK_BIAS_MERGED)
+            & ~BLOCK_BIAS_QUEUED;
+    } while (!header->shared.compare_exchange_weak(old_value, new_value,
+                                                   std::memory_order_acq_rel,
+                                                   std::memory_order_relaxed));
+    return new_value == BLOCK_BIAS_MERGED;
+}
+
+static void _Block_bias_merge_all(struct block_bias_header *list) {
+    while (list) {
+        struct block_bias_header *header = list;
+        list = list->next;
+        if (_Block_bias_merge(header)) {
+            _Block_deallocate(_Block_bias_block(header));
+        }
+    }
+}
+
+static void _Block_bias_drain(struct block_bias_thread *self) {
+    _Block_lock(&self->lock);
+    struct block_bias_header *list = self->queue;
+    self->queue = NULL;
+    self->pending.store(false, std::memory_order_relaxed);
+    _Block_unlock(&self->lock);
+    _Block_bias_merge_all(list);
+}
+
+// TSD destructor: merge whatever is queued, and let later releases of the
+// remaining blocks merge them themselves.
+static void _Block_bias_thread_exit(void *arg) {
+    struct block_bias_thread *self = (struct block_bias_thread *)arg;
+    _Block_lock(&self->lock);
+    self->dead = true;
+    struct block_bias_header *list = self->queue;
+    self->queue = NULL;
+    _Block_unlock(&self->lock);
+    _Block_bias_merge_all(list);
+}
+
+// A non-owner took `shared` negative: hand the block to its owner for a
+// merge. Returns true if the owner is gone and the merge freed the block.
+static bool _Block_bias_enqueue(struct block_bias_header *header) {
+    struct block_bias_thread *owner = _Block_bias_threads[header->owner];
+
+    _Block_lock(&owner->lock);
+    bool dead = owner->dead;
+    if (!dead) {
+        header->next = owner->queue;
+        owner->queue = header;
+        owner->pending.store(true, std::memory_order_relaxed);
+    }
+    _Block_unlock(&owner->lock);
+
+    return dead && _Block_bias_merge(header);
+}
+
+// Allocate a biased heap block of `size` bytes. Returns NULL when biasing
+// is off.
+static void *_Block_bias_alloc(size_t size, int32_t *storage) {
+    pthread_once(&_Block_storage_once, _Block_storage_init);
+    if (!_Block_use_bias) return NULL;
+
+    struct block_bias_header *header = (struct block_bias_header *)
+        _Block_alloc_block(BLOCK_BIAS_HEADER_SIZE + size, storage);
+    if (!header) return NULL;
+    *storage |= BLOCK_BIASED;
+
+    struct block_bias_thread *self = _Block_bias_self_create();
+    header->next = NULL;
+    if (self) {
+        header->owner = self->id;
+        header->biased = 1;
+        header->shared.store(0, std::memory_order_relaxed);
+    } else {
+        header->owner = 0;
+        header->biased = 0;
+        header->shared.store(BLOCK_BIAS_ONE | BLOCK_BIAS_MERGED, std::memory_order_relaxed);
+    }
+    return _Block_bias_block(header);
+}
+
+static void _Block_bias_free(struct Block_layout *aBlock, size_t size, int32_t flags) {
+    _Block_free_block(_Block_bias_header(aBlock), BLOCK_BIAS_HEADER_SIZE + size, flags);
+}
+
+// Only the owner reads `biased`, and it stays 0 once merged.
+static inline bool _Block_bias_is_owner(struct block_bias_header *header,
+                                        struct block_bias_thread *self) {
+    return self && header->owner == self->id && header->biased > 0;
+}
+
+static void _Block_bias_retain(struct Block_layout *aBlock) {
+    struct block_bias_header *header = _Block_bias_header(aBlock);
+    if (_Block_bias_is_owner(header, _Block_bias_self())) {
+        header->biased++;
+    } else {
+        header->shared.fetch_add(BLOCK_BIAS_ONE, std::memory_order_relaxed);
+    }
+}
+
+static void _Block_bias_retain_n(struct Block_layout *aBlock, uint32_t n) {
+    struct block_bias_header *header = _Block_bias_header(aBlock);
+    if (_Block_bias_is_owner(header, _Block_bias_self())) {
+        header->biased += n;
+    } else {
+        header->shared.fetch_add((int32_t)n * BLOCK_BIAS_ONE, std::memory_order_relaxed);
+    }
+}
+
+// As latching_incr_int_not_deallocating.
+static bool _Block_bias_try_retain(struct Block_layout *aBlock) {
+    struct block_bias_header *header = _Block_bias_header(aBlock);
+    if (_Block_bias_is_owner(header, _Block_bias_self())) {
+        header->biased++;
+        return true;
+    }
+    int32_t old_value = header->shared.load(std::memory_order_relaxed);
+    while (1) {
+        if ((old_value & ~BLOCK_BIAS_QUEUED) == BLOCK_BIAS_MERGED) {
+            return false;
+        }
+        if (header->shared.compare_exchange_weak(old_value, old_value + BLOCK_BIAS_ONE,
+                                                 std::memory_order_acquire,
+                                                 std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+// As latching_decr_int_should_deallocate.
+static bool _Block_bias_release(struct Block_layout *aBlock) {
+    struct block_bias_header *header = _Block_bias_header(aBlock);
+    struct block_bias_thread *self = _Block_bias_self();
+
+    if (_Block_bias_is_owner(header, self)) {
+        // We hold a reference, so draining cannot free this block, but it
+        // may merge it.
+        if (os_slowpath(self->pending.load(std::memory_order_relaxed))) {
+            _Block_bias_drain(self);
+        }
+        if (_Block_bias_is_owner(header, self)) {
+            if (--header->biased > 0) return false;
+            int32_t old_value = header->shared.fetch_or(BLOCK_BIAS_MERGED,
+                                                        std::memory_order_acq_rel);
+            // A queued block is freed by the owner's next merge pass.
+            return old_value == 0;
+        }
+    }
+
+    int32_t old_value = header->shared.load(std::memory_order_relaxed);
+    while (1) {
+        int32_t new_value = old_value - BLOCK_BIAS_ONE;
+        bool enqueue = false;
+        if (new_value < 0 && !(old_value & (BLOCK_BIAS_MERGED|BLOCK_BIAS_QUEUED))) {
+            new_value |= BLOCK_BIAS_QUEUED;
+            enqueue = true;
+        }
+        if (header->shared.compare_exchange_weak(old_value, new_value,
+                                                 std::memory_order_acq_rel,
+                                                 std::memory_order_relaxed)) {
+            if (enqueue) return _Block_bias_enqueue(header);
+            return new_value == BLOCK_BIAS_MERGED;
+        }
+    }
+}
+
+/**************************************************************************
+Sharded refcounts
+
+Block_shard moves a heap block's count changes into per-CPU slots, so
+retains and releases on different CPUs touch different cache lines. The
+block's own refcount keeps the reference Block_shard took over, so it
+cannot reach zero while sharded and the slots only hold signed deltas.
+Block_unshard folds the deltas back into the flags and drops that
+reference, so the release that can deallocate always sees an exact count.
+
+A sharded block's `reserved` word names its shard: a table index and a
+generation. Each slot packs the generation above its 32-bit delta and is
+only updated by a CAS that checks it. Folding a slot bumps its
+generation, so a thread that read `reserved` just before Block_unshard
+fails its CAS. It then waits for Block_unshard to fold every slot and
+clear `reserved` before falling back to the flags: a release of a count
+still sitting in an unfolded slot must not reach the flags first. The
+shard can be reused for another block right away. Shards are never
+freed.
+***************************************************************************/
+
+#define BLOCK_SHARD_SLOTS        64
+#define BLOCK_SHARD_INDEX_BITS   12
+#define BLOCK_SHARD_MAX          (1 << BLOCK_SHARD_INDEX_BITS)
+#define BLOCK_SHARD_GEN_MASK     ((1u << (32 - BLOCK_SHARD_INDEX_BITS)) - 1)
+
+struct block_shard_slot {
+    std::atomic<uint64_t> value;        // generation << 32 | (uint32_t)delta
+} __attribute__((aligned(64)));
+
+struct block_shard {
+    struct block_shard_slot slots[BLOCK_SHARD_SLOTS];
+    uint32_t generation;
+    uint32_t next_free;                 // index, while on the free list
+};
+
+static block_lock_t _Block_shard_lock;
+static struct block_shard *_Block_shards[BLOCK_SHARD_MAX];
+static uint32_t _Block_shard_free_list;
+static uint32_t _Block_shard_count = 1;  // index 0 means "not sharded"
+
+static inline unsigned _Block_cpu_number(void) {
+#if __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0) return (unsigned)cpu;
+#elif __APPLE__ && __has_include(<os/tsd.h>)
+    return (unsigned)_os_cpu_number();
+#endif
+    // Without a CPU number, spread threads by their stacks.
+    int local;
+    return (unsigned)((uintptr_t)&local >> 14);
+}
+
+// Apply delta to the calling CPU's slot of a sharded block. Returns false
+// if the block is not sharded (anymore); use the flags instead.
+static bool _Block_shard_add(struct Block_layout *aBlock, int32_t delta) {
+    uint32_t tag = (uint32_t)_Block_atomic_int(&aBlock->reserved)->load(std::memory_order_acquire);
+    if (!tag) return false;
+
+    struct block_shard *shard = _Block_shards[tag & (BLOCK_SHARD_MAX - 1)];
+    uint64_t generation = tag >> BLOCK_SHARD_INDEX_BITS;
+    std::atomic<uint64_t> *slot =
+        &shard->slots[_Block_cpu_number() % BLOCK_SHARD_SLOTS].value;
+
+    uint64_t old_value = slot->load(std::memory_order_relaxed);
+    while (1) {
+        if ((old_value >> 32) != generation) {
+            // Block_unshard is folding the slots.
+            while ((uint32_t)_Block_atomic_int(&aBlock->reserved)->load(std::memory_order_acquire) == tag) {
+                sched_yield();
+            }
+            return false;
+        }
+        uint32_t count = (uint32_t)((int32_t)(uint32_t)old_value + delta);
+        if (slot->compare_exchange_weak(old_value, (generation << 32) | count,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+void Block_shard(const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock || ! (aBlock->flags & BLOCK_NEEDS_FREE)) return;
+    if (aBlock->flags & (BLOCK_PINNED | BLOCK_BIASED)) return;
+    os_assert(aBlock->reserved == 0);
+
+    _Block_lock(&_Block_shard_lock);
+    uint32_t index = _Block_shard_free_list;
+    struct block_shard *shard = NULL;
+    if (index) {
+        shard = _Block_shards[index];
+        _Block_shard_free_list = shard->next_free;
+    } else if (_Block_shard_count < BLOCK_SHARD_MAX) {
+        shard = (struct block_shard *)calloc(1, sizeof(*shard));
+        if (shard) {
+            index = _Block_shard_count++;
+            _Block_shards[index] = shard;
+        }
+    }
+    _Block_unlock(&_Block_shard_lock);
+    if (!shard) return;     // out of shards: stay unsharded
+
+    uint32_t tag = (shard->generation << BLOCK_SHARD_INDEX_BITS) | index;
+    _Block_atomic_int(&aBlock->reserved)->store((int32_t)tag, std::memory_order_release);
+}
+
+void Block_unshard(const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock || ! (aBlock->flags & BLOCK_NEEDS_FREE)) return;
+
+    uint32_t tag = (uint32_t)_Block_atomic_int(&aBlock->reserved)->load(std::memory_order_acquire);
+    if (!tag) {
+        // Block_shard had no effect
+        _Block_release(aBlock);
+        return;
+    }
+    uint32_t index = tag & (BLOCK_SHARD_MAX - 1);
+    struct block_shard *shard = _Block_shards[index];
+
+    // Close every slot and collect the deltas.
+    uint32_t generation = (shard->generation + 1) & BLOCK_SHARD_GEN_MASK;
+    uint64_t closed = (uint64_t)generation << 32;
+    int64_t total = 0;
+    for (int i = 0; i < BLOCK_SHARD_SLOTS; i++) {
+        uint64_t old_value = shard->slots[i].value.exchange(closed, std::memory_order_acq_rel);
+        total += (int32_t)(uint32_t)old_value;
+    }
+
+    // Every other retain and release is waiting for `reserved` to clear,
+    // and our reference is still in the flags, so this cannot deallocate.
+    if (total > 0) {
+        latching_incr_int_n(&aBlock->flags, (uint32_t)total);
+    }
+    if (total < 0) {
+        bool dead = latching_decr_int_n_should_deallocate(&aBlock->flags, (uint32_t)-total);
+        os_assert(!dead);
+    }
+    _Block_atomic_int(&aBlock->reserved)->store(0, std::memory_order_release);
+
+    _Block_lock(&_Block_shard_lock);
+    shard->generation = generation;
+    shard->next_free = _Block_shard_free_list;
+    _Block_shard_free_list = index;
+    _Block_unlock(&_Block_shard_lock);
+
+    _Block_release(aBlock);
+}
+
+/****************************************************************************
+Accessors for block descriptor fields
+*****************************************************************************/
+#if 0
+static struct Block_descriptor_1 * _Block_descriptor_1(struct Block_layout *aBlock)
+{
+    return aBlock->descriptor;
+}
+#endif
+
+static struct Block_descriptor_2 * _Block_descriptor_2(struct Block_layout *aBlock)
+{
+    // 根据 BLOCK_HAS_COPY_DISPOSE 来判断是否有 Block_descriptor_2
+    if (! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE)) return NULL;
+    // 因为有无是编译器确定的，在Block结构体中并无保留，
+    // 所以需要使用 指针相加 的方式来确定其指针位置。有就执行，没有就 return NULL。
+    // 首先找到 descriptor 的位置，向后移动 sizeof(struct Block_descriptor_1) 的长度，
+    // 强转，看是否是 Block_descriptor_2 类型
+    uint8_t *desc = (uint8_t *)aBlock->descriptor;
+    desc += sizeof(struct Block_descriptor_1); // 指针移动
+    
+    return (struct Block_descriptor_2 *)desc;
+}
+
+static struct Block_descriptor_3 * _Block_descriptor_3(struct Block_layout *aBlock)
+{
+    // 根据 BLOCK_HAS_SIGNATURE 来判断是否有 Block_descriptor_3
+    // 处理完全同上
+    if (! (aBlock->flags & BLOCK_HAS_SIGNATURE)) return NULL;
+    
+    uint8_t *desc = (uint8_t *)aBlock->descriptor;
+    desc += sizeof(struct Block_descriptor_1);
+    
+    // 如果有 Block_descriptor_2,
+    // 则指针移动越过 Block_descriptor_2
+    if (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) {
+        desc += sizeof(struct Block_descriptor_2);
+    }
+    
+    return (struct Block_descriptor_3 *)desc;
+}
+
+/****************************************************************************
+Block shapes
+*****************************************************************************/
+
+// Everything the runtime needs to know about a block beyond its header
+// depends only on its descriptor: the size, the helpers, the signature
+// and layout strings, and what the helpers do. A shape record caches all
+// of it, and records are interned in a lock-free table keyed by the
+// descriptor's address so each descriptor is examined once. Descriptors
+// are immutable, so a lookup never reads the descriptor again; DEBUG
+// builds check the record against it.
+//
+// The extended layout of a block lists every captured pointer and what the
+// compiler's copy and dispose helpers do with it. Unless C++ objects are
+// captured, the helpers only call _Block_object_assign and
+// _Block_object_dispose once per pointer, so the runtime can do the same
+// work from the layout without calling them. The shape holds the layout
+// decoded into a plan of runs. Layouts with __weak captures or unknown
+// opcodes get no plan and keep using the helpers.
+
+#define BLOCK_COPY_PLAN_MAX_OPS     32
+#define BLOCK_SHAPE_TABLE_SIZE      4096
+#define BLOCK_SHAPE_PROBES          8
+
+// The flag bits that must agree between a block and its descriptor's shape.
+#define BLOCK_SHAPE_FLAGS \
+    (BLOCK_HAS_COPY_DISPOSE | BLOCK_HAS_CTOR | BLOCK_HAS_SIGNATURE | \
+     BLOCK_HAS_EXTENDED_LAYOUT)
+
+// count consecutive captured pointers of one kind
+struct block_copy_op {
+    uint32_t offset;
+    uint16_t count;
+    uint16_t kind;          // BLOCK_LAYOUT_STRONG or BLOCK_LAYOUT_BYREF
+};
+
+struct block_copy_plan {
+    uint32_t count;
+    uint32_t byrefs;        // __block captures among the ops
+    struct block_copy_op ops[];
+};
+
+struct block_call;
+
+struct block_shape {
+    size_t size;
+    int32_t flags;                  // BLOCK_SHAPE_FLAGS of the descriptor
+    uint8_t size_class;             // slab class, or BLOCK_SLAB_CLASS_COUNT
+    bool pod;                       // no copy or dispose helper
+    BlockCopyFunction copy;         // from descriptor 2, NULL if pod
+    BlockDisposeFunction dispose;
+    const char *signature;
+    const char *layout;
+    const struct block_copy_plan *plan;     // NULL: call the helpers
+    std::atomic<const struct block_call *> call;    // built on first use
+    std::atomic<uint64_t> copies;           // with LIBCLOSURE_BLOCK_STATS
+    std::atomic<uint64_t> disposes;
+};
+
+struct block_shape_entry {
+    std::atomic<uintptr_t> descriptor;
+    std::atomic<struct block_shape *> shape;    // NULL while building
+};
+
+static struct block_shape_entry _Block_shapes[BLOCK_SHAPE_TABLE_SIZE];
+
+static struct Block_byref *_Block_byref_copy(const void *arg);
+static void _Block_byref_release(const void *arg);
+
+static bool _Block_copy_plan_add(struct block_copy_op *ops, uint32_t *count,
+                                 size_t offset, unsigned n, unsigned kind)
+{
+    if (n == 0) return true;
+    if (offset > UINT32_MAX) return false;
+    struct block_copy_op *last = *count ? &ops[*count - 1] : NULL;
+    if (last && last->kind == kind &&
+        last->offset + last->count * sizeof(void *) == offset &&
+        last->count + n <= UINT16_MAX) {
+        last->count += n;
+        return true;
+    }
+    if (*count == BLOCK_COPY_PLAN_MAX_OPS) return false;
+    ops[*count].offset = (uint32_t)offset;
+    ops[*count].count = (uint16_t)n;
+    ops[*count].kind = (uint16_t)kind;
+    (*count)++;
+    return true;
+}
+
+// Decode the extended layout of aBlock, or return NULL if the helpers
+// must be used.
+static const struct block_copy_plan *_Block_copy_plan_build(struct Block_layout *aBlock)
+{
+    struct Block_descriptor_3 *desc3 = _Block_descriptor_3(aBlock);
+    if (!desc3) return NULL;
+
+    struct block_copy_op ops[BLOCK_COPY_PLAN_MAX_OPS];
+    uint32_t count = 0;
+    uintptr_t layout = (uintptr_t)desc3->layout;
+    size_t offset = sizeof(struct Block_layout);
+
+    // A block with helpers but no object captures has something
+    // the layout does not describe.
+    if (layout == 0) return NULL;
+
+    if (layout < 0x1000) {
+        unsigned strong = (layout >> 8) & 0xf;
+        unsigned byref  = (layout >> 4) & 0xf;
+        unsigned weak   = layout & 0xf;
+        if (weak) return NULL;
+        _Block_copy_plan_add(ops, &count, offset, strong, BLOCK_LAYOUT_STRONG);
+        offset += strong * sizeof(void *);
+        _Block_copy_plan_add(ops, &count, offset, byref, BLOCK_LAYOUT_BYREF);
+    } else {
+        for (const uint8_t *p = (const uint8_t *)layout; *p; p++) {
+            unsigned n = (*p & 0xf) + 1;
+            unsigned kind = *p >> 4;
+            switch (kind) {
+              case BLOCK_LAYOUT_NON_OBJECT_BYTES:
+                offset += n;
+                break;
+              case BLOCK_LAYOUT_NON_OBJECT_WORDS:
+              case BLOCK_LAYOUT_UNRETAINED:
+                offset += n * sizeof(void *);
+                break;
+              case BLOCK_LAYOUT_STRONG:
+              case BLOCK_LAYOUT_BYREF:
+                if (!_Block_copy_plan_add(ops, &count, offset, n, kind)) return NULL;
+                offset += n * sizeof(void *);
+                break;
+              default:
+                return NULL;
+            }
+        }
+    }
+    if (offset > aBlock->descriptor->size) return NULL;
+
+    struct block_copy_plan *plan = (struct block_copy_plan *)
+        malloc(sizeof(struct block_copy_plan) + count * sizeof(struct block_copy_op));
+    if (!plan) return NULL;
+    plan->count = count;
+    plan->byrefs = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (ops[i].kind == BLOCK_LAYOUT_BYREF) plan->byrefs += ops[i].count;
+    }
+    memcpy(plan->ops, ops, count * sizeof(struct block_copy_op));
+    return plan;
+}
+
+static struct block_shape *_Block_shape_build(struct Block_layout *aBlock)
+{
+    struct block_shape *shape = (struct block_shape *)calloc(1, sizeof(struct block_shape));
+    if (!shape) return NULL;
+
+    struct Block_descriptor_3 *desc3 = _Block_descriptor_3(aBlock);
+    shape->size = aBlock->descriptor->size;
+    shape->flags = aBlock->flags & BLOCK_SHAPE_FLAGS;
+    shape->size_class = shape->size <= BLOCK_SLAB_MAX_SIZE
+        ? (uint8_t)_Block_slab_class(shape->size) : BLOCK_SLAB_CLASS_COUNT;
+    struct Block_descriptor_2 *desc2 = _Block_descriptor_2(aBlock);
+    shape->pod = !desc2;
+    if (desc2) {
+        shape->copy = desc2->copy;
+        shape->dispose = desc2->dispose;
+    }
+    shape->signature = desc3 ? desc3->signature : NULL;
+    shape->layout = desc3 ? desc3->layout : NULL;
+    if (desc2 &&
+        (shape->flags & (BLOCK_HAS_EXTENDED_LAYOUT|BLOCK_HAS_CTOR)) == BLOCK_HAS_EXTENDED_LAYOUT) {
+        shape->plan = _Block_copy_plan_build(aBlock);
+    }
+    return shape;
+}
+
+#if DEBUG
+// Whether shape still says what aBlock's descriptor says.
+static bool _Block_shape_is_current(const struct block_shape *shape,
+                                    struct Block_layout *aBlock)
+{
+    if (shape->size != aBlock->descriptor->size) return false;
+    struct Block_descriptor_2 *desc2 = _Block_descriptor_2(aBlock);
+    if (desc2 && (shape->copy != desc2->copy || shape->dispose != desc2->dispose)) {
+        return false;
+    }
+    struct Block_descriptor_3 *desc3 = _Block_descriptor_3(aBlock);
+    return !desc3 || (shape->signature == desc3->signature && shape->layout == desc3->layout);
+}
+#endif
+
+// Returns the shape of aBlock's descriptor, or NULL if it is not in the
+// table yet and cannot be added now. Callers then read the descriptor.
+static struct block_shape *_Block_shape(struct Block_layout *aBlock)
+{
+    uintptr_t key = (uintptr_t)aBlock->descriptor;
+    size_t index = (key >> 4) ^ (key >> 16);
+    for (int probe = 0; probe < BLOCK_SHAPE_PROBES; probe++, index++) {
+        struct block_shape_entry *entry =
+            &_Block_shapes[index & (BLOCK_SHAPE_TABLE_SIZE - 1)];
+        uintptr_t found = entry->descriptor.load(std::memory_order_acquire);
+        if (found == 0) {
+            if (!entry->descriptor.compare_exchange_strong(found, key,
+                                                           std::memory_order_acq_rel)) {
+                if (found != key) continue;
+                // Another thread is building this shape.
+                return NULL;
+            }
+            struct block_shape *shape = _Block_shape_build(aBlock);
+            if (!shape) {
+                entry->descriptor.store(0, std::memory_order_release);
+                return NULL;
+            }
+            entry->shape.store(shape, std::memory_order_release);
+            return shape;
+        }
+        if (found == key) {
+            struct block_shape *shape = entry->shape.load(std::memory_order_acquire);
+            if (shape && shape->flags != (aBlock->flags & BLOCK_SHAPE_FLAGS)) return NULL;
+#if DEBUG
+            os_assert(!shape || _Block_shape_is_current(shape, aBlock));
+#endif
+            return shape;
+        }
+    }
+    return NULL;
+}
+
+// Captured blocks are described as strong pointers like any object, but
+// the helpers copy them with _Block_copy instead of retaining them.
+// Tagged pointers are never blocks and must not be dereferenced.
+static bool _Block_capture_is_block(const void *object)
+{
+    if (!object || ((uintptr_t)object & (sizeof(void *) - 1))) return false;
+#if __arm64__
+    if ((intptr_t)object < 0) return false;
+#endif
+    void *isa = *(void * const *)object;
+    return isa == _NSConcreteStackBlock || isa == _NSConcreteMallocBlock ||
+        isa == _NSConcreteGlobalBlock;
+}
+
+static void _Block_copy_plan_copy(const struct block_copy_plan *plan,
+                                  void *result, struct Block_layout *aBlock)
+{
+    for (uint32_t i = 0; i < plan->count; i++) {
+        const struct block_copy_op *op = &plan->ops[i];
+        void **dst = (void **)((char *)result + op->offset);
+        void **src = (void **)((char *)aBlock + op->offset);
+        if (op->kind == BLOCK_LAYOUT_BYREF) {
+            for (unsigned j = 0; j < op->count; j++) {
+                dst[j] = _Block_byref_copy(src[j]);
+            }
+            continue;
+        }
+        for (unsigned j = 0; j < op->count; j++) {
+            void *object = src[j];
+            if (_Block_capture_is_block(object)) {
+                dst[j] = _Block_copy(object);
+            } else {
+                _Block_retain_object(object);
+                dst[j] = object;
+            }
+        }
+    }
+}
+
+static void _Block_copy_plan_dispose(const struct block_copy_plan *plan,
+                                     struct Block_layout *aBlock)
+{
+    for (uint32_t i = 0; i < plan->count; i++) {
+        const struct block_copy_op *op = &plan->ops[i];
+        void **field = (void **)((char *)aBlock + op->offset);
+        if (op->kind == BLOCK_LAYOUT_BYREF) {
+            for (unsigned j = 0; j < op->count; j++) {
+                _Block_byref_release(field[j]);
+            }
+            continue;
+        }
+        for (unsigned j = 0; j < op->count; j++) {
+            if (_Block_capture_is_block(field[j])) {
+                _Block_release(field[j]);
+            } else {
+                _Block_release_object(field[j]);
+            }
+        }
+    }
+}
+
+static void _Block_call_copy_helper(void *result, struct Block_layout *aBlock)
+{
+    // 这里如果返回找到了 Block_descriptor_2，就执行它的 copy 函数，
+    // 如果没有找到就直接 return
+    // 这个 copy 函数，就是上面的 __main_block_copy_0 函数
+    if (! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) && !_Block_collect_stats) return;
+
+    struct block_shape *shape = _Block_shape(aBlock);
+    if (os_fastpath(shape)) {
+        if (_Block_collect_stats) {
+            shape->copies.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (shape->plan) {
+            _Block_copy_plan_copy(shape->plan, result, aBlock);
+        } else if (shape->copy) {
+            (*shape->copy)(result, aBlock);
+        }
+        return;
+    }
+
+    struct Block_descriptor_2 *desc = _Block_descriptor_2(aBlock);
+    if (!desc) return;
+
+    (*desc->copy)(result, aBlock); // do fixup
+}
+
+static void _Block_call_dispose_helper(struct Block_layout *aBlock)
+{
+    // 这里同上面
+    // 这里如果返回找到了 Block_descriptor_2，就执行它的 dispose 函数，
+    // 如果没有找到就直接 return
+    // 这个 dispose 函数，就是上面的 __main_block_copy_0 函数
+    if (! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) && !_Block_collect_stats) return;
+
+    struct block_shape *shape = _Block_shape(aBlock);
+    if (os_fastpath(shape)) {
+        if (_Block_collect_stats) {
+            shape->disposes.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (shape->plan) {
+            _Block_copy_plan_dispose(shape->plan, aBlock);
+        } else if (shape->dispose) {
+            (*shape->dispose)(aBlock);
+        }
+        return;
+    }
+
+    struct Block_descriptor_2 *desc = _Block_descriptor_2(aBlock);
+    if (!desc) return;
+
+    (*desc->dispose)(aBlock);
+}
+
+// Find the captured __block variables of a block from its extended layout.
+// Stores up to `max` byte offsets into the block and returns how many there
+// are, or -1 if the layout is missing or cannot be interpreted.
+// In the string form an operand N stands for N+1 bytes or words, as the
+// compiler emits it; in the compact form the counts are exact.
+static int _Block_extended_layout_byrefs(struct Block_layout *aBlock, size_t *offsets, int max)
+{
+    if (! (aBlock->flags & BLOCK_HAS_EXTENDED_LAYOUT)) return -1;
+    struct Block_descriptor_3 *desc3 = _Block_descriptor_3(aBlock);
+    if (!desc3) return -1;
+
+    uintptr_t layout = (uintptr_t)desc3->layout;
+    size_t offset = sizeof(struct Block_layout);
+    int count = 0;
+
+    if (layout < 0x1000) {
+        unsigned strong = (layout >> 8) & 0xf;
+        unsigned byref  = (layout >> 4) & 0xf;
+        offset += strong * sizeof(void *);
+        for (unsigned i = 0; i < byref; i++, offset += sizeof(void *)) {
+            if (count == max) return -1;
+            offsets[count++] = offset;
+        }
+        return count;
+    }
+
+    for (const uint8_t *p = (const uint8_t *)layout; *p; p++) {
+        unsigned n = (*p & 0xf) + 1;
+        switch (*p >> 4) {
+          case BLOCK_LAYOUT_NON_OBJECT_BYTES:
+            offset += n;
+            break;
+          case BLOCK_LAYOUT_NON_OBJECT_WORDS:
+          case BLOCK_LAYOUT_STRONG:
+          case BLOCK_LAYOUT_WEAK:
+          case BLOCK_LAYOUT_UNRETAINED:
+            offset += n * sizeof(void *);
+            break;
+          case BLOCK_LAYOUT_BYREF:
+            for (unsigned i = 0; i < n; i++, offset += sizeof(void *)) {
+                if (count == max) return -1;
+                offsets[count++] = offset;
+            }
+            break;
+          default:
+            return -1;
+        }
+    }
+    return count;
+}
+
+// As _Block_extended_layout_byrefs, from a decoded plan.
+static int _Block_copy_plan_byrefs(const struct block_copy_plan *plan, size_t *offsets, int max)
+{
+    int count = 0;
+    for (uint32_t i = 0; i < plan->count; i++) {
+        const struct block_copy_op *op = &plan->ops[i];
+        if (op->kind != BLOCK_LAYOUT_BYREF) continue;
+        for (unsigned j = 0; j < op->count; j++) {
+            if (count == max) return -1;
+            offsets[count++] = op->offset + j * sizeof(void *);
+        }
+    }
+    return count;
+}
+
+// If this copy of stack block aBlock will be the first to promote some of
+// its __block variables, allocate the block and those variables together
+// and publish ctx so that _Block_byref_copy uses the reserved space.
+// Returns the storage for the block, or NULL to use ordinary storage.
+static struct Block_layout *
+_Block_coalloc_begin(struct Block_layout *aBlock, struct block_coalloc_context *ctx)
+{
+    if (! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE)) return NULL;
+
+    // The shape's plan knows where the __block captures are without
+    // decoding the layout again.
+    size_t offsets[BLOCK_COALLOC_MAX_BYREFS];
+    int n;
+    struct block_shape *shape = _Block_shape(aBlock);
+    if (os_fastpath(shape && shape->plan)) {
+        if (shape->plan->byrefs == 0) return NULL;
+        n = _Block_copy_plan_byrefs(shape->plan, offsets, BLOCK_COALLOC_MAX_BYREFS);
+    } else {
+        n = _Block_extended_layout_byrefs(aBlock, offsets, BLOCK_COALLOC_MAX_BYREFS);
+    }
+    if (n <= 0) return NULL;
+
+    size_t total = BLOCK_COALLOC_HEADER_SIZE +
+        BLOCK_COALLOC_TAG_SIZE + BLOCK_COALLOC_ROUND(aBlock->descriptor->size);
+    ctx->count = 0;
+    for (int i = 0; i < n; i++) {
+        struct Block_byref *src = *(struct Block_byref **)((char *)aBlock + offsets[i]);
+        if (!src || (src->forwarding->flags & BLOCK_REFCOUNT_MASK) != 0) continue;
+
+        bool duplicate = false;
+        for (int j = 0; j < ctx->count; j++) duplicate |= (ctx->sources[j] == src);
+        if (duplicate) continue;
+
+        ctx->sources[ctx->count++] = src;
+        total += BLOCK_COALLOC_TAG_SIZE + BLOCK_COALLOC_ROUND(src->size);
+    }
+    if (ctx->count == 0) return NULL;
+
+    // Arenas already bump-allocate everything together.
+    if (_Block_arena_current()) return NULL;
+
+    // This also sets up the TSD slot the context is published in.
+    int32_t storage;
+    struct block_coalloc_chunk *chunk =
+        (struct block_coalloc_chunk *)_Block_alloc_block(total, &storage);
+    if (!chunk) return NULL;
+    chunk->live = 0;
+    chunk->size = (uint32_t)total;
+
+    size_t offset = BLOCK_COALLOC_HEADER_SIZE;
+    struct Block_layout *result =
+        (struct Block_layout *)_Block_coalloc_place(chunk, offset);
+    offset += BLOCK_COALLOC_TAG_SIZE + BLOCK_COALLOC_ROUND(aBlock->descriptor->size);
+    for (int i = 0; i < ctx->count; i++) {
+        ctx->slots[i] = _Block_coalloc_place(chunk, offset);
+        offset += BLOCK_COALLOC_TAG_SIZE + BLOCK_COALLOC_ROUND(ctx->sources[i]->size);
+    }
+
+    ctx->chunk = chunk;
+    ctx->claimed = 0;
+    ctx->previous = (struct block_coalloc_context *)_Block_tsd_get(BLOCK_TSD_COALLOC);
+    _Block_tsd_set(BLOCK_TSD_COALLOC, ctx);
+    return result;
+}
+
+// The copy helper has run. Space for byrefs that were promoted elsewhere
+// in the meantime stays unused until the chunk is freed.
+static void _Block_coalloc_end(struct block_coalloc_context *ctx)
+{
+    _Block_tsd_set(BLOCK_TSD_COALLOC, ctx->previous);
+    ctx->chunk->live = 1 + ctx->claimed;
+}
+
+/*******************************************************************************
+Internal Support routines for copying
+********************************************************************************/
+
+#if !TARGET_OS_WIN32
+#pragma mark Copy/Release support
+#endif
+
+// Blocks without copy helpers are promoted by a plain bitcopy. Most of
+// them capture a few words, so the common sizes get a fixed-length copy
+// that the compiler turns into straight-line vector moves, with the heap
+// header written as part of the same sequence instead of patched after a
+// generic memmove.
+
+template <size_t Words>
+static inline void _Block_copy_pod_words(struct Block_layout *result,
+                                         const struct Block_layout *aBlock,
+                                         int32_t flags)
+{
+    memcpy(result + 1, aBlock + 1, Words * sizeof(void *));
+    result->flags = flags;
+    result->reserved = aBlock->reserved;
+    result->invoke = aBlock->invoke;
+    result->descriptor = aBlock->descriptor;
+    // Set isa last so memory analysis tools see a fully-initialized object.
+    result->isa = _NSConcreteMallocBlock;
+}
+
+// Copy POD block aBlock into result as a heap block with the given runtime
+// flags. Returns false if there is no kernel for its size.
+static bool _Block_copy_pod(struct Block_layout *result,
+                            const struct Block_layout *aBlock, int32_t flags)
+{
+    size_t size = aBlock->descriptor->size;
+    if (size < sizeof(struct Block_layout) || (size % sizeof(void *)) != 0) return false;
+
+    flags |= aBlock->flags & ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);
+    switch ((size - sizeof(struct Block_layout)) / sizeof(void *)) {
+      case 0: _Block_copy_pod_words<0>(result, aBlock, flags); return true;
+      case 1: _Block_copy_pod_words<1>(result, aBlock, flags); return true;
+      case 2: _Block_copy_pod_words<2>(result, aBlock, flags); return true;
+      case 3: _Block_copy_pod_words<3>(result, aBlock, flags); return true;
+      case 4: _Block_copy_pod_words<4>(result, aBlock, flags); return true;
+      case 5: _Block_copy_pod_words<5>(result, aBlock, flags); return true;
+      case 6: _Block_copy_pod_words<6>(result, aBlock, flags); return true;
+      case 7: _Block_copy_pod_words<7>(result, aBlock, flags); return true;
+      case 8: _Block_copy_pod_words<8>(result, aBlock, flags); return true;
+      default: return false;
+    }
+}
+
+// Stack blocks that capture nothing are all alike, so copies of them share
+// one immortal instance per invoke function and descriptor. The instance
+// is made a global block, exactly what the compiler emits when it can.
+// With ptrauth the invoke pointer is signed with its address and cannot be
+// compared, so those blocks are always copied. An instance whose flags no
+// longer match its descriptor's belongs to an unloaded image and is
+// replaced; it is leaked, since its users may still hold it.
+#define BLOCK_CANONICAL_TABLE_SIZE  256
+#define BLOCK_CANONICAL_PROBES      8
+
+static std::atomic<struct Block_layout *> _Block_canonical_blocks[BLOCK_CANONICAL_TABLE_SIZE];
+
+// Whether shared instance `found` was made from a block with aBlock's
+// compile-time flags.
+static inline bool _Block_instance_flags_match(const struct Block_layout *found,
+                                               const struct Block_layout *aBlock) {
+    return ! ((found->flags ^ aBlock->flags) &
+              ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING|BLOCK_IS_GLOBAL));
+}
+
+static inline bool _Block_is_capture_less(const struct Block_layout *aBlock) {
+    return aBlock->descriptor->size == sizeof(struct Block_layout) &&
+        ! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE);
+}
+
+// Returns the shared instance for capture-less stack block aBlock, or NULL
+// to copy it as usual.
+static struct Block_layout *_Block_canonical(const struct Block_layout *aBlock)
+{
+#if __has_feature(ptrauth_calls)
+    return NULL;
+#else
+    uintptr_t key = (uintptr_t)aBlock->invoke ^ ((uintptr_t)aBlock->descriptor >> 4);
+    size_t index = (key >> 4) ^ (key >> 12);
+    struct Block_layout *created = NULL;
+    for (int probe = 0; probe < BLOCK_CANONICAL_PROBES; probe++, index++) {
+        std::atomic<struct Block_layout *> *slot =
+            &_Block_canonical_blocks[index & (BLOCK_CANONICAL_TABLE_SIZE - 1)];
+        struct Block_layout *found = slot->load(std::memory_order_acquire);
+        bool stale = found && found->invoke == aBlock->invoke &&
+            found->descriptor == aBlock->descriptor &&
+            !_Block_instance_flags_match(found, aBlock);
+        if (!found || stale) {
+            if (!created) {
+                // Not from the heap allocators: an arena or a custom
+                // allocator must never see it.
+                created = (struct Block_layout *)malloc(sizeof(struct Block_layout));
+                if (!created) return NULL;
+                created->flags = (aBlock->flags & ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING)) |
+                    BLOCK_IS_GLOBAL;
+                created->reserved = 0;
+                created->invoke = aBlock->invoke;
+                created->descriptor = aBlock->descriptor;
+                created->isa = _NSConcreteGlobalBlock;
+            }
+            if (slot->compare_exchange_strong(found, created, std::memory_order_acq_rel)) {
+                return created;
+            }
+        }
+        if (found->invoke == aBlock->invoke && found->descriptor == aBlock->descriptor &&
+            _Block_instance_flags_match(found, aBlock)) {
+            free(created);
+            return found;
+        }
+    }
+    free(created);
+    return NULL;
+#endif
+}
+
+// Copy, or bump refcount, of a block.  If really copying, call the copy helper if present.
+// 复制或增加块的引用计数。如果确实要复制，则调用 copy helper.（如果有）
+void *_Block_copy(const void *arg) {
+    // 1. 先声明一个Block_layout结构体类型的指针，如果传入的Block为NULL就直接返回。
+    struct Block_layout *aBlock;
+
+    if (!arg) return NULL;
+    
+    // The following would be better done as a switch statement
+    // 以下最好作为 Switch 语句来完成
+    
+    // 2. 如果Block有值就强转成Block_layout的指针类型。
+    aBlock = (struct Block_layout *)arg;
+    
+    // BLOCK_REFCOUNT_MASK 栈 block
+    // BLOCK_NEEDS_FREE 堆 block
+    // BLOCK_IS_GLOBAL 全局 block
+    // 3. 如果 Block 的 flags 表明该 Block 为堆 Block 时，
+    // 就对其引用计数递增，然后返回原 Block。
+    if (aBlock->flags & BLOCK_NEEDS_FREE) {
+        // ‼️‼️‼️ 这里表明，堆区 Block 执行 copy 操作，只是增加其引用。如果引用已经最大，则什么都不做。
+        // latches on high
+        if (aBlock->flags & BLOCK_PINNED) {
+            // immortal until Block_unpin: no write to the block at all
+        } else if (aBlock->reserved && _Block_shard_add(aBlock, 1)) {
+            // counted in this CPU's slot
+        } else if (aBlock->flags & BLOCK_BIASED) {
+            _Block_bias_retain(aBlock);
+        } else {
+            latching_incr_int(&aBlock->flags);
+        }
+        return aBlock;
+    }
+    // 4. 如果Block为全局Block就不做其他处理直接返回。
+    else if (aBlock->flags & BLOCK_IS_GLOBAL) {
+        // ‼️‼️‼️ 这里表明，如果是全局 Block 执行 copy 操作，则直接返回自身
+        return aBlock;
+    }
+    else {
+        // Its a stack block. Make a copy.
+        // ‼️‼️‼️ 这里表明，如果是栈区 Block 执行 copy 操作，则把栈区 Block 复制到堆区
+        // 5. 该 else 中就是栈 Block了，
+        // 按原 Block 的内存大小分配一块相同大小的内存，
+        // 如果失败就返回NULL。
+        if (_Block_is_capture_less(aBlock)) {
+            struct Block_layout *canonical = _Block_canonical(aBlock);
+            if (canonical) return canonical;
+        }
+        struct block_coalloc_context coalloc;
+        int32_t storage = BLOCK_COALLOCATED;
+        struct Block_layout *result = _Block_coalloc_begin(aBlock, &coalloc);
+        if (!result) {
+            result = (struct Block_layout *)_Block_bias_alloc(aBlock->descriptor->size, &storage);
+        }
+        if (!result) {
+            result = (struct Block_layout *)_Block_alloc_block(aBlock->descriptor->size, &storage); // 在堆区开辟空间
+        }
+        
+        if (!result) return NULL;
+        if (! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) &&
+            _Block_copy_pod(result, aBlock, BLOCK_NEEDS_FREE | storage | 2)) {
+            if (os_slowpath(_Block_collect_stats)) _Block_call_copy_helper(result, aBlock);
+            return result;
+        }
+        // 6. memmove() 用于复制位元，将 aBlock 的所有信息 copy 到 result 的位置上。
+        // memmove 函数，如果旧空间和新空间有交集，那么以新空间为主，复制完毕，旧空间会被破坏
+        
+        // 原型：void *memmove(void* dest, const void* src, size_t count );
+        // 头文件：<string.h>
+        // 功能：由 src 所指内存区域复制 count 个字节到 dest 所指内存区域。
+        // 相关函数：memset、memcpy
+        
+        memmove(result, aBlock, aBlock->descriptor->size); // bitcopy first
+        
+#if __has_feature(ptrauth_calls)
+        // Resign the invoke pointer as it uses address authentication.
+        result->invoke = aBlock->invoke;
+#endif
+        // reset refcount
+        
+        // BLOCK_DEALLOCATING =      (0x0001),
+        // BLOCK_REFCOUNT_MASK =     (0xfffe),
+        // 它们两者 ｜ 一下就是: 0xffff
+        
+        // 7. 将新Block的引用计数置零。
+        // BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING就是0xffff，
+        // ~(0xffff)就是0x0000，
+        // result->flags 与 0x0000 与等 就将 result->flags 的后 16 位置零。
+        // 然后将新 Block 标识为 堆Block 并将其引用计数置为 2。
+        // ｜2 表示把 后 16 位置为 0x0002，表示引用计数为 2
+        result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING); // XXX not needed
+        result->flags |= BLOCK_NEEDS_FREE | storage | 2;  // logical refcount 1
+        
+        // 8. 如果有copy_dispose助手，就执行 Block 的保存的 copy 函数，
+        // 就是上面的 __main_block_copy_0。
+        // 在 _Block_descriptor_2 函数中，
+        // 用 BLOCK_HAS_COPY_DISPOSE 来判断是否有 Block_descriptor_2，
+        // 且取 Block 的Block_descriptor_2 时，
+        // 因为有无是编译器确定的，在 Block 结构体中并无保留，
+        // 所以需要使用指针相加的方式来确定其指针位置。
+        // 有就执行，没有就 return 。
+        _Block_call_copy_helper(result, aBlock);
+        if (storage & BLOCK_COALLOCATED) _Block_coalloc_end(&coalloc);
+        // Set isa last so memory analysis tools see a fully-initialized object.
+        // 9. 将堆 Block 的isa指针置为 _NSConcreteMallocBlock，返回新Block，end。
+        // 这里 isa 被修正，我们用 clang 转换时显示为是栈区 Block 是不能确认的
+        // ‼️‼️‼️ 堆区 block
+        result->isa = _NSConcreteMallocBlock;
+        
+        return result;
+    }
+}
+
+
+// Runtime entry points for maintaining the sharing knowledge of byref data blocks.
+
+// A closure has been copied and its fixup routine is asking us to fix up the reference to the shared byref data
+// Closures that aren't copied must still work, so everyone always accesses variables after dereferencing the forwarding ptr.
+// We ask if the byref pointer that we know about has already been copied to the heap, and if so, increment and return it.
+// Otherwise we need to copy it and update the stack forwarding pointer
+static struct Block_byref *_Block_byref_copy(const void *arg) {
+    // 3.1 强制转换入参为(struct Block_byref *)类型。
+    struct Block_byref *src = (struct Block_byref *)arg;
+
+    // 当入参为栈 byref 时执行此步，
+    // 表示先是栈 Block 有 __block 变量，
+    // 此时处于把栈 block 复制到堆中，
+    // 此时的操作是把这个 __block 变量复制到堆中去
+    if ((src->forwarding->flags & BLOCK_REFCOUNT_MASK) == 0) {
+        // src points to stack
+        // 3.2 当入参为栈 byref 时执行此步。
+        // 分配一份与当前 byref 相同的内存，并将 isa 指针置为 NULL。
+        int32_t storage = BLOCK_BYREF_COALLOCATED;
+        struct Block_byref *copy = _Block_coalloc_claim_byref(src);
+        if (!copy) {
+            copy = (struct Block_byref *)_Block_alloc_byref(src->size, &storage); // __Block_byref_val_0 这种结构体实例
+        }
+        copy->isa = NULL;
+        
+        // byref value 4 is logical refcount of 2: one for caller, one for stack
+        // 3.3 将新 byref 的引用计数置为 4 并标记为堆，一份为调用方、一份为栈持有，所以引用计数为4。
+        copy->flags = src->flags | BLOCK_BYREF_NEEDS_FREE | storage | 4;
+        
+        // 3.4 然后将当前 byref 和 malloc 的 byref 的 forwading 都指向 堆byref，然后操作堆栈都是同一份东西。
+        // 这两行特关键：
+        // ‼️‼️‼️ 正印证那一句，copy 发生后栈区 Block 的 __block 变量的 __forwarding 指向堆中的 __block 变量
+        // 堆中的 __block 的 __forwarding 指向自己
+        copy->forwarding = copy; // patch heap copy to point to itself
+        src->forwarding = copy;  // patch stack to point to heap copy
+        
+        // 3.5 最后将size赋值
+        copy->size = src->size;
+
+        if (src->flags & BLOCK_BYREF_HAS_COPY_DISPOSE) {
+            // Trust copy helper to copy everything of interest
+            // If more than one field shows up in a byref block this is wrong XXX
+            // 3.6 如果 src(入参) byref 含有内存管理的变量即有 copy_dispose 助手，执行此步。
+            // 分别取出 src 的 Block_byref_2 和 copy 的 Block_byref_2。
+            struct Block_byref_2 *src2 = (struct Block_byref_2 *)(src+1);
+            struct Block_byref_2 *copy2 = (struct Block_byref_2 *)(copy+1);
+            // 3.7 将 src 的管理内存函数指针赋值给 copy。
+            copy2->byref_keep = src2->byref_keep;
+            copy2->byref_destroy = src2->byref_destroy;
+
+            if (src->flags & BLOCK_BYREF_LAYOUT_EXTENDED) {
+                // 3.8 如果 src 含有 Block_byref_3，则将 src 的 Block_byref_3 赋值给 copy
+                struct Block_byref_3 *src3 = (struct Block_byref_3 *)(src2+1);
+                struct Block_byref_3 *copy3 = (struct Block_byref_3*)(copy2+1);
+                
+                copy3->layout = src3->layout;
+            }
+            
+            // 3.9 执行 byref 的 byref_keep 函数(即 _Block_object_assign，不过会加上 BLOCK_BYREF_CALLER 标记)，管理捕获的对象内存。
+            (*src2->byref_keep)(copy, src);
+        }
+        else {
+            // Bitwise copy.
+            // This copy includes Block_byref_3, if any.
+            // 3.10 如果捕获的是普通变量，就没有 Block_byref_2，copy+1 和src+1 指向的就是 Block_byref_3，执行字节拷贝。
+            memmove(copy+1, src+1, src->size - sizeof(*src));
+        }
+    }
+    // already copied to heap
+    else if ((src->forwarding->flags & BLOCK_BYREF_NEEDS_FREE) == BLOCK_BYREF_NEEDS_FREE) {
+        // 3.11 如果该 byref 是存在于堆，则只需要增加其引用计数。
+        latching_incr_int(&src->forwarding->flags);
+    }
+    
+    // 3.12 返回forwarding。
+    return src->forwarding;
+}
+
+static void _Block_byref_release(const void *arg) {
+    // 1.1 将入参强转成(struct Block_byref *)，并将入参替换成 forwarding 。（指向堆中的 __block 变量）
+    struct Block_byref *byref = (struct Block_byref *)arg;
+
+    // dereference the forwarding pointer since the compiler isn't doing this anymore (ever?)
     byref = byref->forwarding;
     
-    if (byref->flags & BLOCK_BYREF_NEEDS_FREE) {
-        // 1.2 如果该byref在堆上执行此步，如果该 byref 还被标记为栈则执行断言。
-        int32_t refcount = byref->flags & BLOCK_REFCOUNT_MASK;
-        os_assert(refcount);
-        
-        if (latching_decr_int_should_deallocate(&byref->flags)) {
-            // 1.3 此函数上面有讲就不多提，判断是否需要释放内存，也可能是只需要减少引用，但是还有别的 block 使用它，此时还不能被废弃
-            if (byref->flags & BLOCK_BYREF_HAS_COPY_DISPOSE) {
-                // 1.4 如果有 copy_dispose 助手就执行 byref_destroy 管理捕获的变量内存。
-                struct Block_byref_2 *byref2 = (struct Block_byref_2 *)(byref+1);
-                (*byref2->byref_destroy)(byref);
+    if (byref->flags & BLOCK_BYREF_NEEDS_FREE) {
+        // 1.2 如果该byref在堆上执行此步，如果该 byref 还被标记为栈则执行断言。
+        int32_t refcount = byref->flags & BLOCK_REFCOUNT_MASK;
+        os_assert(refcount);
+        
+        if (latching_decr_int_should_deallocate(&byref->flags)) {
+            // 1.3 此函数上面有讲就不多提，判断是否需要释放内存，也可能是只需要减少引用，但是还有别的 block 使用它，此时还不能被废弃
+            if (byref->flags & BLOCK_BYREF_HAS_COPY_DISPOSE) {
+                // 1.4 如果有 copy_dispose 助手就执行 byref_destroy 管理捕获的变量内存。
+                struct Block_byref_2 *byref2 = (struct Block_byref_2 *)(byref+1);
+                (*byref2->byref_destroy)(byref);
+            }
+            
+            // 1.5 释放byref。
+            _Block_free_byref(byref, byref->size, byref->flags);
+        }
+    }
+}
+
+
+/************************************************************
+ *
+ * API supporting SPI
+ * _Block_copy, _Block_release, and (old) _Block_destroy
+ *
+ ***********************************************************/
+
+#if !TARGET_OS_WIN32
+#pragma mark SPI/API
+#endif
+
+// API entry point to release a copied Block
+// API 入口点以释放复制的 Block
+void _Block_release(const void *arg) {
+    // 1. 将入参 arg 强转成 (struct Block_layout *) 类型，如果入参为 NULL 则直接返回。
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return;
+    
+    // 2. 如果入参为全局 Block 则返回不做处理。
+    // global block 在程序结束时释放
+    if (aBlock->flags & BLOCK_IS_GLOBAL) return;
+    
+    // 3. 如果入参不为堆Block则返回不做处理。
+    if (! (aBlock->flags & BLOCK_NEEDS_FREE)) return;
+    
+    // 被 Block_pin 固定的 Block 不做任何写操作
+    if (aBlock->flags & BLOCK_PINNED) return;
+    if (aBlock->reserved && _Block_shard_add(aBlock, -1)) return;
+    
+    // 4. 判断aBlock的引用计数是否需要释放内存。
+    // 与 copy 同样的，latching_decr_int_should_deallocate
+    // 也做了一次循环和原子性判断保证原子性。
+    // 如果该 block 的引用计数过高(0xfffe)或者过低(0)返回 false 不做处理。如果其引用计数为 2，
+    // 则将其引用计数 -1 即 BLOCK_DEALLOCATING 标明正在释放，返回 true，
+    // 如果大于 2 则将其引用计数 -2 并返回 false。
+    bool should_deallocate = (aBlock->flags & BLOCK_BIASED)
+        ? _Block_bias_release(aBlock)
+        : latching_decr_int_should_deallocate(&aBlock->flags);
+    if (should_deallocate) {
+        // 5. 如果上一步骤返回了 ture，标明了该 block 需要被释放，就进入这个 if
+        _Block_deallocate(aBlock);
+    }
+}
+
+// The two halves of deallocating a heap block whose last reference is gone.
+static void _Block_dispose_instance(struct Block_layout *aBlock) {
+    // Biased blocks decide outside the flags word; mark them for
+    // _Block_isDeallocating.
+    if (aBlock->flags & BLOCK_BIASED) {
+        _Block_atomic_int(&aBlock->flags)->fetch_or(BLOCK_DEALLOCATING,
+                                                      std::memory_order_relaxed);
+    }
+    // 如果 aBlock 含有 copy_dispose 助手就执行 aBlock 中的 dispose 函数，
+    // 与 copy 中的对应不再多做解释。
+    _Block_call_dispose_helper(aBlock);
+}
+
+static void _Block_free_instance(struct Block_layout *aBlock) {
+    // 6. 默认没做其他操作
+    // _Block_destructInstance = callbacks->destructInstance;
+    _Block_destructInstance(aBlock);
+    // 7. 释放 aBlock 内存
+    if (aBlock->flags & BLOCK_BIASED) {
+        _Block_bias_free(aBlock, aBlock->descriptor->size, aBlock->flags);
+    } else {
+        _Block_free_block(aBlock, aBlock->descriptor->size, aBlock->flags);
+    }
+}
+
+static void _Block_deallocate(struct Block_layout *aBlock) {
+    _Block_dispose_instance(aBlock);
+    _Block_free_instance(aBlock);
+}
+
+// Deallocate several dead blocks: every dispose helper first, then every
+// free, so each phase runs over warm code and data.
+static void _Block_deallocate_batch(struct Block_layout **blocks, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        _Block_dispose_instance(blocks[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        _Block_free_instance(blocks[i]);
+    }
+}
+
+// Drop n references to a heap block at once.
+static bool _Block_release_n_should_deallocate(struct Block_layout *aBlock, uint32_t n) {
+    if (aBlock->flags & BLOCK_PINNED) return false;
+    if (aBlock->reserved && n <= INT32_MAX && _Block_shard_add(aBlock, -(int32_t)n)) {
+        return false;
+    }
+    if (aBlock->flags & BLOCK_BIASED) {
+        while (n--) {
+            if (_Block_bias_release(aBlock)) return true;
+        }
+        return false;
+    }
+    return latching_decr_int_n_should_deallocate(&aBlock->flags, n);
+}
+
+
+/**************************************************************************
+Deferred release
+
+Block_release_deferred parks a release in a per-thread buffer. Repeated
+deferred releases of one block add up to a single refcount update, and
+Block_drain_deferred (or thread exit, or a full buffer) applies them all,
+running the dispose helpers of the blocks that die together before any of
+them is freed.
+***************************************************************************/
+
+#define BLOCK_DEFERRED_CAPACITY  256     // distinct blocks per batch
+#define BLOCK_DEFERRED_SLOTS     (2 * BLOCK_DEFERRED_CAPACITY)
+
+struct block_deferred_entry {
+    struct Block_layout *block;
+    uint32_t count;
+};
+
+struct block_deferred_buffer {
+    uint32_t used;
+    uint16_t order[BLOCK_DEFERRED_CAPACITY];    // slots in arrival order
+    struct block_deferred_entry slots[BLOCK_DEFERRED_SLOTS];
+};
+
+static void _Block_deferred_drain(struct block_deferred_buffer *buffer) {
+    struct Block_layout *dead[BLOCK_DEFERRED_CAPACITY];
+    uint32_t deadCount = 0;
+
+    // Empty the buffer before any dispose helper can defer more releases.
+    for (uint32_t i = 0; i < buffer->used; i++) {
+        struct block_deferred_entry *entry = &buffer->slots[buffer->order[i]];
+        if (_Block_release_n_should_deallocate(entry->block, entry->count)) {
+            dead[deadCount++] = entry->block;
+        }
+        entry->block = NULL;
+    }
+    buffer->used = 0;
+
+    _Block_deallocate_batch(dead, deadCount);
+}
+
+static void _Block_deferred_thread_exit(void *arg) {
+    struct block_deferred_buffer *buffer = (struct block_deferred_buffer *)arg;
+    _Block_deferred_drain(buffer);
+    free(buffer);
+}
+
+void Block_release_deferred(const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return;
+    if (aBlock->flags & BLOCK_IS_GLOBAL) return;
+    if (! (aBlock->flags & BLOCK_NEEDS_FREE)) return;
+    if (aBlock->flags & BLOCK_PINNED) return;
+
+    pthread_once(&_Block_storage_once, _Block_storage_init);
+    struct block_deferred_buffer *buffer =
+        (struct block_deferred_buffer *)_Block_tsd_get(BLOCK_TSD_DEFERRED);
+    if (os_slowpath(!buffer)) {
+        buffer = (struct block_deferred_buffer *)calloc(1, sizeof(*buffer));
+        if (!buffer) {
+            _Block_release(aBlock);
+            return;
+        }
+        _Block_tsd_set(BLOCK_TSD_DEFERRED, buffer);
+    }
+
+    uintptr_t hash = ((uintptr_t)aBlock >> 4) * 0x9E3779B1u;
+    uint32_t slot = (uint32_t)(hash >> 7) % BLOCK_DEFERRED_SLOTS;
+    while (buffer->slots[slot].block) {
+        if (buffer->slots[slot].block == aBlock &&
+            buffer->slots[slot].count < UINT32_MAX) {
+            buffer->slots[slot].count++;
+            return;
+        }
+        slot = (slot + 1) % BLOCK_DEFERRED_SLOTS;
+    }
+
+    if (buffer->used == BLOCK_DEFERRED_CAPACITY) {
+        _Block_deferred_drain(buffer);
+        Block_release_deferred(aBlock);
+        return;
+    }
+    buffer->slots[slot].block = aBlock;
+    buffer->slots[slot].count = 1;
+    buffer->order[buffer->used++] = (uint16_t)slot;
+}
+
+void Block_drain_deferred(void) {
+    if (!_Block_storage_initialized) return;
+    struct block_deferred_buffer *buffer =
+        (struct block_deferred_buffer *)_Block_tsd_get(BLOCK_TSD_DEFERRED);
+    if (buffer) _Block_deferred_drain(buffer);
+}
+
+
+/**************************************************************************
+Pinned blocks
+
+A pinned heap block is immortal: _Block_copy and _Block_release see
+BLOCK_PINNED in the flags they already load and return without writing
+to the block, as they do for global blocks. Nothing is counted while
+pinned, so copies and releases must not straddle Block_pin or
+Block_unpin. The pin owns the reference its caller gave up, and
+Block_unpin releases it.
+***************************************************************************/
+
+void Block_pin(const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock || ! (aBlock->flags & BLOCK_NEEDS_FREE)) return;
+
+    int32_t old_flags = _Block_atomic_int(&aBlock->flags)->fetch_or(
+        BLOCK_PINNED, std::memory_order_relaxed);
+    os_assert(! (old_flags & BLOCK_PINNED));
+}
+
+void Block_unpin(const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock || ! (aBlock->flags & BLOCK_NEEDS_FREE)) return;
+
+    int32_t old_flags = _Block_atomic_int(&aBlock->flags)->fetch_and(
+        ~BLOCK_PINNED, std::memory_order_acquire);
+    os_assert(old_flags & BLOCK_PINNED);
+    _Block_release(aBlock);
+}
+
+
+/**************************************************************************
+Counted and bulk copy and release
+***************************************************************************/
+
+#define BLOCK_BULK_PREFETCH_DISTANCE  8
+#define BLOCK_BULK_BATCH              64
+#define BLOCK_BULK_MAX_STEP           (1u << 20)    // references per count update
+
+void *Block_retain_n(const void *arg, size_t n) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock || n == 0) return aBlock;
+
+    if (! (aBlock->flags & BLOCK_NEEDS_FREE)) {
+        // Global blocks are returned as is; stack blocks are copied once
+        // and the copy takes the remaining references.
+        aBlock = (struct Block_layout *)_Block_copy(aBlock);
+        if (!aBlock || ! (aBlock->flags & BLOCK_NEEDS_FREE)) return aBlock;
+        n--;
+    }
+
+    while (n) {
+        uint32_t step = n < BLOCK_BULK_MAX_STEP ? (uint32_t)n : BLOCK_BULK_MAX_STEP;
+        n -= step;
+        if (aBlock->flags & BLOCK_PINNED) {
+            break;
+        } else if (aBlock->reserved && _Block_shard_add(aBlock, (int32_t)step)) {
+            continue;
+        } else if (aBlock->flags & BLOCK_BIASED) {
+            _Block_bias_retain_n(aBlock, step);
+        } else {
+            latching_incr_int_n(&aBlock->flags, step);
+        }
+    }
+    return aBlock;
+}
+
+void Block_release_n(const void *arg, size_t n) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return;
+    if (aBlock->flags & BLOCK_IS_GLOBAL) return;
+    if (! (aBlock->flags & BLOCK_NEEDS_FREE)) return;
+
+    while (n) {
+        uint32_t step = n < BLOCK_BULK_MAX_STEP ? (uint32_t)n : BLOCK_BULK_MAX_STEP;
+        n -= step;
+        if (_Block_release_n_should_deallocate(aBlock, step)) {
+            _Block_deallocate(aBlock);
+            return;
+        }
+    }
+}
+
+void Block_copy_array(void **copies, const void * const *blocks, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (i + BLOCK_BULK_PREFETCH_DISTANCE < count &&
+            blocks[i + BLOCK_BULK_PREFETCH_DISTANCE]) {
+            __builtin_prefetch(blocks[i + BLOCK_BULK_PREFETCH_DISTANCE], 1);
+        }
+        copies[i] = _Block_copy(blocks[i]);
+    }
+}
+
+void Block_release_array(const void * const *blocks, size_t count) {
+    struct Block_layout *dead[BLOCK_BULK_BATCH];
+    size_t deadCount = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (i + BLOCK_BULK_PREFETCH_DISTANCE < count &&
+            blocks[i + BLOCK_BULK_PREFETCH_DISTANCE]) {
+            __builtin_prefetch(blocks[i + BLOCK_BULK_PREFETCH_DISTANCE], 1);
+        }
+        struct Block_layout *aBlock = (struct Block_layout *)blocks[i];
+        if (!aBlock) continue;
+        if (aBlock->flags & BLOCK_IS_GLOBAL) continue;
+        if (! (aBlock->flags & BLOCK_NEEDS_FREE)) continue;
+
+        if (_Block_release_n_should_deallocate(aBlock, 1)) {
+            dead[deadCount++] = aBlock;
+            if (deadCount == BLOCK_BULK_BATCH) {
+                _Block_deallocate_batch(dead, deadCount);
+                deadCount = 0;
+            }
+        }
+    }
+    _Block_deallocate_batch(dead, deadCount);
+}
+
+/***************************************************************************
+Copies into caller-provided storage
+***************************************************************************/
+
+// Flag bits describing a heap copy and its storage, which an in-place copy
+// must not inherit from its source.
+#define BLOCK_HEAP_FLAGS \
+    (BLOCK_REFCOUNT_MASK | BLOCK_DEALLOCATING | BLOCK_NEEDS_FREE | \
+     BLOCK_IS_GLOBAL | BLOCK_IN_ARENA | BLOCK_COALLOCATED | \
+     BLOCK_REFCOUNT_OVERFLOW | BLOCK_BIASED | BLOCK_PINNED)
+
+void *Block_copy_into(void *buffer, size_t capacity, const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return NULL;
+    if (aBlock->descriptor->size > capacity) return NULL;
+
+    struct Block_layout *result = (struct Block_layout *)buffer;
+    memmove(result, aBlock, aBlock->descriptor->size); // bitcopy first
+#if __has_feature(ptrauth_calls)
+    // Resign the invoke pointer as it uses address authentication.
+    result->invoke = aBlock->invoke;
+#endif
+    result->flags &= ~BLOCK_HEAP_FLAGS;
+    result->reserved = 0;
+    _Block_call_copy_helper(result, aBlock);
+    // Set isa last so memory analysis tools see a fully-initialized object.
+    result->isa = _NSConcreteStackBlock;
+    return result;
+}
+
+void Block_destroy_in_place(void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return;
+    _Block_call_dispose_helper(aBlock);
+}
+
+/***************************************************************************
+Interned copies
+***************************************************************************/
+
+#define BLOCK_INTERN_TABLE_SIZE  4096
+#define BLOCK_INTERN_PROBES      16
+
+// The size is the descriptor's when the copy was made: the descriptor may
+// have been unloaded and its address reused since.
+struct block_interned {
+    size_t size;
+    struct Block_layout block;      // followed by the captures
+};
+
+static std::atomic<struct block_interned *> _Block_interned_blocks[BLOCK_INTERN_TABLE_SIZE];
+
+static uintptr_t _Block_intern_hash(const struct Block_layout *aBlock, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = (hash ^ (uintptr_t)aBlock->invoke) * 0x100000001b3ULL;
+    hash = (hash ^ (uintptr_t)aBlock->descriptor) * 0x100000001b3ULL;
+    const uint8_t *bytes = (const uint8_t *)(aBlock + 1);
+    for (size_t i = 0; i < size - sizeof(struct Block_layout); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return (uintptr_t)(hash ^ (hash >> 29));
+}
+
+static bool _Block_intern_equal(const struct block_interned *found,
+                                const struct Block_layout *aBlock, size_t size)
+{
+    return found->size == size &&
+        found->block.invoke == aBlock->invoke &&
+        found->block.descriptor == aBlock->descriptor &&
+        _Block_instance_flags_match(&found->block, aBlock) &&
+        0 == memcmp(&found->block + 1, aBlock + 1, size - sizeof(struct Block_layout));
+}
+
+void *Block_copy_interned(const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return NULL;
+    if (aBlock->flags & (BLOCK_NEEDS_FREE | BLOCK_IS_GLOBAL | BLOCK_HAS_COPY_DISPOSE)) {
+        return _Block_copy(aBlock);
+    }
+#if __has_feature(ptrauth_calls)
+    // Signed invoke pointers differ per copy and cannot be compared.
+    return _Block_copy(aBlock);
+#else
+    size_t size = aBlock->descriptor->size;
+    if (size < sizeof(struct Block_layout)) return _Block_copy(aBlock);
+
+    // Like the shared capture-less instances, interned copies are global
+    // blocks in memory no arena or custom allocator owns.
+    size_t index = _Block_intern_hash(aBlock, size);
+    struct block_interned *created = NULL;
+    for (int probe = 0; probe < BLOCK_INTERN_PROBES; probe++, index++) {
+        std::atomic<struct block_interned *> *slot =
+            &_Block_interned_blocks[index & (BLOCK_INTERN_TABLE_SIZE - 1)];
+        struct block_interned *found = slot->load(std::memory_order_acquire);
+        if (!found) {
+            if (!created) {
+                created = (struct block_interned *)
+                    malloc(offsetof(struct block_interned, block) + size);
+                if (!created) return NULL;
+                created->size = size;
+                memmove(&created->block, aBlock, size);
+                created->block.flags = (aBlock->flags & ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING)) |
+                    BLOCK_IS_GLOBAL;
+                created->block.reserved = 0;
+                created->block.isa = _NSConcreteGlobalBlock;
+            }
+            if (slot->compare_exchange_strong(found, created, std::memory_order_acq_rel)) {
+                return &created->block;
+            }
+        }
+        if (_Block_intern_equal(found, aBlock, size)) {
+            free(created);
+            return &found->block;
+        }
+    }
+    free(created);
+    return _Block_copy(aBlock);
+#endif
+}
+
+/***************************************************************************
+Graph copies
+***************************************************************************/
+
+#define BLOCK_GRAPH_MAX_BLOCKS  32
+
+struct block_graph {
+    int count;
+    struct Block_layout *sources[BLOCK_GRAPH_MAX_BLOCKS];
+    struct Block_layout *copies[BLOCK_GRAPH_MAX_BLOCKS];
+    int references[BLOCK_GRAPH_MAX_BLOCKS];  // to each copy
+};
+
+static int _Block_graph_find(const struct block_graph *graph, const void *block) {
+    for (int i = 0; i < graph->count; i++) {
+        if (graph->sources[i] == block) return i;
+    }
+    return -1;
+}
+
+// Collect the stack blocks reachable from graph->sources[0] and the stack
+// byrefs they capture, breadth first. Returns false if there are too many.
+static bool _Block_graph_collect(struct block_graph *graph,
+                                 struct block_coalloc_context *ctx)
+{
+    for (int next = 0; next < graph->count; next++) {
+        struct Block_layout *aBlock = graph->sources[next];
+        if (! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE)) continue;
+        struct block_shape *shape = _Block_shape(aBlock);
+        if (!shape || !shape->plan) continue;   // its helper copies the rest
+
+        const struct block_copy_plan *plan = shape->plan;
+        for (uint32_t i = 0; i < plan->count; i++) {
+            const struct block_copy_op *op = &plan->ops[i];
+            void **field = (void **)((char *)aBlock + op->offset);
+            for (unsigned j = 0; j < op->count; j++) {
+                if (op->kind == BLOCK_LAYOUT_BYREF) {
+                    struct Block_byref *src = (struct Block_byref *)field[j];
+                    if ((src->forwarding->flags & BLOCK_REFCOUNT_MASK) != 0) continue;
+                    bool duplicate = false;
+                    for (int k = 0; k < ctx->count; k++) duplicate |= (ctx->sources[k] == src);
+                    if (duplicate) continue;
+                    if (ctx->count == BLOCK_COALLOC_MAX_BYREFS) return false;
+                    ctx->sources[ctx->count++] = src;
+                } else {
+                    struct Block_layout *inner = (struct Block_layout *)field[j];
+                    if (!_Block_capture_is_block(inner)) continue;
+                    if (inner->isa != _NSConcreteStackBlock) continue;
+                    if (_Block_graph_find(graph, inner) >= 0) continue;
+                    if (graph->count == BLOCK_GRAPH_MAX_BLOCKS) return false;
+                    graph->sources[graph->count++] = inner;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Fill in graph->copies[index] from its source. Captured blocks of the
+// graph are pointed at their copies, each such capture holding one
+// reference; everything else is copied as _Block_copy would. The copies
+// are filled in breadth first, so a capture may point at a copy that is
+// not written yet: references are only counted here, and stored once
+// every copy is written.
+static void _Block_graph_copy_one(struct block_graph *graph, int index)
+{
+    struct Block_layout *aBlock = graph->sources[index];
+    struct Block_layout *result = graph->copies[index];
+
+    memmove(result, aBlock, aBlock->descriptor->size); // bitcopy first
+#if __has_feature(ptrauth_calls)
+    // Resign the invoke pointer as it uses address authentication.
+    result->invoke = aBlock->invoke;
+#endif
+    result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);
+    result->flags |= BLOCK_NEEDS_FREE | BLOCK_COALLOCATED | 2;  // logical refcount 1
+
+    struct block_shape *shape = (aBlock->flags & BLOCK_HAS_COPY_DISPOSE)
+        ? _Block_shape(aBlock) : NULL;
+    if (!shape || !shape->plan) {
+        _Block_call_copy_helper(result, aBlock);
+    } else {
+        const struct block_copy_plan *plan = shape->plan;
+        for (uint32_t i = 0; i < plan->count; i++) {
+            const struct block_copy_op *op = &plan->ops[i];
+            void **dst = (void **)((char *)result + op->offset);
+            void **src = (void **)((char *)aBlock + op->offset);
+            for (unsigned j = 0; j < op->count; j++) {
+                int inner = op->kind == BLOCK_LAYOUT_STRONG
+                    ? _Block_graph_find(graph, src[j]) : -1;
+                if (op->kind == BLOCK_LAYOUT_BYREF) {
+                    dst[j] = _Block_byref_copy(src[j]);
+                } else if (inner < 0) {
+                    if (_Block_capture_is_block(src[j])) {
+                        dst[j] = _Block_copy(src[j]);
+                    } else {
+                        _Block_retain_object(src[j]);
+                    }
+                } else {
+                    dst[j] = graph->copies[inner];
+                    graph->references[inner]++;
+                }
+            }
+        }
+    }
+    // Set isa last so memory analysis tools see a fully-initialized object.
+    result->isa = _NSConcreteMallocBlock;
+}
+
+void *Block_copy_graph(const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return NULL;
+    if (aBlock->flags & (BLOCK_NEEDS_FREE | BLOCK_IS_GLOBAL)) return _Block_copy(aBlock);
+
+    struct block_graph graph;
+    struct block_coalloc_context ctx;
+    graph.count = 1;
+    graph.sources[0] = aBlock;
+    ctx.count = 0;
+    if (!_Block_graph_collect(&graph, &ctx) || (graph.count == 1 && ctx.count == 0)) {
+        return _Block_copy(aBlock);
+    }
+
+    // Arenas already bump-allocate everything together.
+    if (_Block_arena_current()) return _Block_copy(aBlock);
+
+    size_t total = BLOCK_COALLOC_HEADER_SIZE;
+    for (int i = 0; i < graph.count; i++) {
+        total += BLOCK_COALLOC_TAG_SIZE + BLOCK_COALLOC_ROUND(graph.sources[i]->descriptor->size);
+    }
+    for (int i = 0; i < ctx.count; i++) {
+        total += BLOCK_COALLOC_TAG_SIZE + BLOCK_COALLOC_ROUND(ctx.sources[i]->size);
+    }
+    if (total > UINT32_MAX) return _Block_copy(aBlock);
+
+    int32_t storage;
+    struct block_coalloc_chunk *chunk =
+        (struct block_coalloc_chunk *)_Block_alloc_block(total, &storage);
+    if (!chunk) return NULL;
+    chunk->live = 0;
+    chunk->size = (uint32_t)total;
+
+    size_t offset = BLOCK_COALLOC_HEADER_SIZE;
+    for (int i = 0; i < graph.count; i++) {
+        graph.copies[i] = (struct Block_layout *)_Block_coalloc_place(chunk, offset);
+        graph.references[i] = (i == 0);     // the caller's reference
+        offset += BLOCK_COALLOC_TAG_SIZE + BLOCK_COALLOC_ROUND(graph.sources[i]->descriptor->size);
+    }
+    for (int i = 0; i < ctx.count; i++) {
+        ctx.slots[i] = _Block_coalloc_place(chunk, offset);
+        offset += BLOCK_COALLOC_TAG_SIZE + BLOCK_COALLOC_ROUND(ctx.sources[i]->size);
+    }
+
+    ctx.chunk = chunk;
+    ctx.claimed = 0;
+    ctx.previous = (struct block_coalloc_context *)_Block_tsd_get(BLOCK_TSD_COALLOC);
+    _Block_tsd_set(BLOCK_TSD_COALLOC, &ctx);
+    for (int i = 0; i < graph.count; i++) {
+        _Block_graph_copy_one(&graph, i);
+    }
+    _Block_tsd_set(BLOCK_TSD_COALLOC, ctx.previous);
+    for (int i = 0; i < graph.count; i++) {
+        struct Block_layout *copy = graph.copies[i];
+        copy->flags = (copy->flags & ~BLOCK_REFCOUNT_MASK) | (2 * graph.references[i]);
+    }
+    chunk->live = graph.count + ctx.claimed;
+
+    return graph.copies[0];
+}
+
+/***************************************************************************
+Moving copies
+***************************************************************************/
+
+// Copy helpers cannot tell a move from a copy by their arguments, so
+// Block_copy_move publishes the block it is promoting while the helper
+// runs and _Block_copy_is_move lets the helper ask.
+
+void *Block_copy_move(const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return NULL;
+    if (aBlock->flags & (BLOCK_NEEDS_FREE | BLOCK_IS_GLOBAL)) return _Block_copy(aBlock);
+    if (! (aBlock->flags & BLOCK_HAS_COPY_DISPOSE)) return _Block_copy(aBlock);
+
+    pthread_once(&_Block_storage_once, _Block_storage_init);
+    void *previous = _Block_tsd_get(BLOCK_TSD_MOVE);
+    _Block_tsd_set(BLOCK_TSD_MOVE, aBlock);
+    void *result = _Block_copy(aBlock);
+    _Block_tsd_set(BLOCK_TSD_MOVE, previous);
+    return result;
+}
+
+bool _Block_copy_is_move(const void *src) {
+    if (!_Block_storage_initialized || !src) return false;
+    return _Block_tsd_get(BLOCK_TSD_MOVE) == src;
+}
+
+/***************************************************************************
+Trampolines
+
+Trampolines are carved from pairs of pages: a data page followed by a code
+page. Every slot of the code page runs the same few instructions, which
+shift the integer arguments up by one, load the block stored at the same
+offset in the data page into the first argument register, and jump to the
+block's invoke function. The code page is written once and then made
+read-only and executable; creating and destroying a trampoline only
+touches the data page. Free slots form a lock-free stack of slot numbers
+with a generation count against ABA; the lock is taken only to map pages.
+***************************************************************************/
+
+#if BLOCK_TRAMPOLINES
+
+#define BLOCK_TRAMPOLINE_MAX_PAGES 4096
+
+#if defined(__x86_64__)
+#define BLOCK_TRAMPOLINE_SLOT_SIZE 32
+#else
+#define BLOCK_TRAMPOLINE_SLOT_SIZE 64
+#endif
+
+// Lives in the data page at the offset of its slot in the code page.
+struct block_trampoline_data {
+    void *block;                    // loaded by the trampoline code
+    uint32_t id;
+    std::atomic<uint32_t> next;     // id + 1 of the next free slot, or 0
+};
+
+static block_lock_t _Block_trampoline_lock;
+static size_t _Block_trampoline_page_size;
+static std::atomic<char *> _Block_trampoline_pages[BLOCK_TRAMPOLINE_MAX_PAGES];
+static std::atomic<uint32_t> _Block_trampoline_page_count;
+static std::atomic<uint64_t> _Block_trampoline_free;   // generation << 32 | (id + 1)
+
+static inline size_t _Block_trampoline_slots_per_page(void) {
+    return _Block_trampoline_page_size / BLOCK_TRAMPOLINE_SLOT_SIZE;
+}
+
+static inline char *_Block_trampoline_code(uint32_t id) {
+    size_t perPage = _Block_trampoline_slots_per_page();
+    char *page = _Block_trampoline_pages[id / perPage].load(std::memory_order_acquire);
+    return page + (id % perPage) * BLOCK_TRAMPOLINE_SLOT_SIZE;
+}
+
+static inline struct block_trampoline_data *_Block_trampoline_data(char *code) {
+    return (struct block_trampoline_data *)(code - _Block_trampoline_page_size);
+}
+
+// Write one slot of trampoline code at `code`.
+static void _Block_trampoline_write(uint8_t *code, size_t page_size) {
+#if defined(__x86_64__)
+    static const uint8_t shift[] = {
+        0xf3, 0x0f, 0x1e, 0xfa,     // endbr64
+        0x4d, 0x89, 0xc1,           // mov %r8, %r9
+        0x49, 0x89, 0xc8,           // mov %rcx, %r8
+        0x48, 0x89, 0xd1,           // mov %rdx, %rcx
+        0x48, 0x89, 0xf2,           // mov %rsi, %rdx
+        0x48, 0x89, 0xfe,           // mov %rdi, %rsi
+        0x48, 0x8b, 0x3d,           // mov disp32(%rip), %rdi
+    };
+    memcpy(code, shift, sizeof(shift));
+    int32_t disp = -(int32_t)page_size - (int32_t)(sizeof(shift) + 4);
+    memcpy(code + sizeof(shift), &disp, 4);
+    static const uint8_t jump[] = {
+        0xff, 0x67, offsetof(struct Block_layout, invoke),  // jmp *invoke(%rdi)
+    };
+    memcpy(code + sizeof(shift) + 4, jump, sizeof(jump));
+#else
+    uint32_t insns[] = {
+        0xaa0603e7,                 // mov x7, x6
+        0xaa0503e6,                 // mov x6, x5
+        0xaa0403e5,                 // mov x5, x4
+        0xaa0303e4,                 // mov x4, x3
+        0xaa0203e3,                 // mov x3, x2
+        0xaa0103e2,                 // mov x2, x1
+        0xaa0003e1,                 // mov x1, x0
+        0x58000000,                 // ldr x0, <data>
+        0xf9400010 | (uint32_t)(offsetof(struct Block_layout, invoke) / 8) << 10,
+                                    // ldr x16, [x0, #invoke]
+        0xd61f0200,                 // br x16
+    };
+    int32_t literal = (-(int32_t)page_size - 7 * 4) / 4;
+    insns[7] |= ((uint32_t)literal & 0x7ffff) << 5;
+    memcpy(code, insns, sizeof(insns));
+#endif
+}
+
+// Map another pair of pages and push its slots, except the first, which
+// is returned. Returns UINT32_MAX if no more pages can be mapped.
+static uint32_t _Block_trampoline_grow(void) {
+    _Block_lock(&_Block_trampoline_lock);
+    if (!_Block_trampoline_page_size) {
+        _Block_trampoline_page_size = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    size_t pageSize = _Block_trampoline_page_size;
+    uint32_t index = _Block_trampoline_page_count.load(std::memory_order_relaxed);
+    char *pages = NULL;
+    if (index < BLOCK_TRAMPOLINE_MAX_PAGES) {
+        void *mapped = mmap(NULL, 2 * pageSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped != MAP_FAILED) pages = (char *)mapped;
+    }
+    if (!pages) {
+        _Block_unlock(&_Block_trampoline_lock);
+        return UINT32_MAX;
+    }
+
+    char *code = pages + pageSize;
+    for (size_t offset = 0; offset < pageSize; offset += BLOCK_TRAMPOLINE_SLOT_SIZE) {
+        _Block_trampoline_write((uint8_t *)code + offset, pageSize);
+    }
+    if (mprotect(code, pageSize, PROT_READ | PROT_EXEC) != 0) {
+        munmap(pages, 2 * pageSize);
+        _Block_unlock(&_Block_trampoline_lock);
+        return UINT32_MAX;
+    }
+    __builtin___clear_cache(code, code + pageSize);
+
+    size_t perPage = _Block_trampoline_slots_per_page();
+    uint32_t first = (uint32_t)(index * perPage);
+    for (size_t i = 0; i < perPage; i++) {
+        _Block_trampoline_data(code + i * BLOCK_TRAMPOLINE_SLOT_SIZE)->id = first + (uint32_t)i;
+    }
+    _Block_trampoline_pages[index].store(code, std::memory_order_release);
+    _Block_trampoline_page_count.store(index + 1, std::memory_order_release);
+    _Block_unlock(&_Block_trampoline_lock);
+
+    // Chain the new slots and push them in one step.
+    for (size_t i = 1; i + 1 < perPage; i++) {
+        _Block_trampoline_data(code + i * BLOCK_TRAMPOLINE_SLOT_SIZE)->next
+            .store(first + (uint32_t)i + 2, std::memory_order_relaxed);
+    }
+    struct block_trampoline_data *last =
+        _Block_trampoline_data(code + (perPage - 1) * BLOCK_TRAMPOLINE_SLOT_SIZE);
+    uint64_t head = _Block_trampoline_free.load(std::memory_order_relaxed);
+    do {
+        last->next.store((uint32_t)head, std::memory_order_relaxed);
+    } while (!_Block_trampoline_free.compare_exchange_weak(
+                 head, ((head >> 32) + 1) << 32 | (first + 2),
+                 std::memory_order_release, std::memory_order_relaxed));
+    return first;
+}
+
+static uint32_t _Block_trampoline_pop(void) {
+    uint64_t head = _Block_trampoline_free.load(std::memory_order_acquire);
+    while ((uint32_t)head) {
+        uint32_t id = (uint32_t)head - 1;
+        uint32_t next = _Block_trampoline_data(_Block_trampoline_code(id))
+            ->next.load(std::memory_order_relaxed);
+        if (_Block_trampoline_free.compare_exchange_weak(
+                head, ((head >> 32) + 1) << 32 | next,
+                std::memory_order_acquire, std::memory_order_acquire)) {
+            return id;
+        }
+    }
+    return _Block_trampoline_grow();
+}
+
+static void _Block_trampoline_push(struct block_trampoline_data *data) {
+    uint64_t head = _Block_trampoline_free.load(std::memory_order_relaxed);
+    do {
+        data->next.store((uint32_t)head, std::memory_order_relaxed);
+    } while (!_Block_trampoline_free.compare_exchange_weak(
+                 head, ((head >> 32) + 1) << 32 | (data->id + 1),
+                 std::memory_order_release, std::memory_order_relaxed));
+}
+
+void *Block_trampoline_create(const void *aBlock) {
+    if (!aBlock) return NULL;
+    uint32_t id = _Block_trampoline_pop();
+    if (id == UINT32_MAX) return NULL;
+
+    char *code = _Block_trampoline_code(id);
+    struct block_trampoline_data *data = _Block_trampoline_data(code);
+    data->block = _Block_copy(aBlock);
+    if (!data->block) {
+        _Block_trampoline_push(data);
+        return NULL;
+    }
+    return code;
+}
+
+void Block_trampoline_destroy(void *trampoline) {
+    if (!trampoline) return;
+    struct block_trampoline_data *data = _Block_trampoline_data((char *)trampoline);
+    os_assert(_Block_trampoline_code(data->id) == (char *)trampoline);
+
+    void *aBlock = data->block;
+    data->block = NULL;
+    _Block_trampoline_push(data);
+    _Block_release(aBlock);
+}
+
+#else
+
+void *Block_trampoline_create(const void *aBlock __unused) {
+    return NULL;
+}
+
+void Block_trampoline_destroy(void *trampoline __unused) {
+}
+
+#endif
+
+/***************************************************************************
+Dynamic invocation
+
+A block's signature is compiled once per descriptor into a call
+descriptor that says which register or stack slot each argument goes to.
+Calls are then made through a single prototype that has one parameter
+for every integer and floating-point argument register plus a few stack
+words. A callee with fewer or differently ordered parameters of the same
+classes finds each of its arguments where it expects it, and ignores the
+rest. Floats travel as the bit pattern of a double's low half, which is
+where the callee reads them.
+***************************************************************************/
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+enum {
+    BLOCK_CALL_VOID,
+    BLOCK_CALL_SINT8, BLOCK_CALL_UINT8, BLOCK_CALL_SINT16, BLOCK_CALL_UINT16,
+    BLOCK_CALL_SINT32, BLOCK_CALL_UINT32, BLOCK_CALL_INT64,
+    BLOCK_CALL_FLOAT, BLOCK_CALL_DOUBLE,
+    BLOCK_CALL_INDIRECT,            // struct returned through a hidden pointer
+};
+
+enum { BLOCK_CALL_INT, BLOCK_CALL_FP, BLOCK_CALL_STACK };
+
+#if defined(__x86_64__)
+#define BLOCK_CALL_INT_REGS         6
+#define BLOCK_CALL_INDIRECT_INT_REGS 5  // the hidden pointer takes %rdi
+#else
+#define BLOCK_CALL_INT_REGS         8
+#define BLOCK_CALL_INDIRECT_INT_REGS 8  // the hidden pointer is in x8
+#endif
+#define BLOCK_CALL_FP_REGS          8
+#if __APPLE__ && defined(__aarch64__)
+// Darwin packs stack arguments by their natural size.
+#define BLOCK_CALL_STACK_WORDS      0
+#else
+#define BLOCK_CALL_STACK_WORDS      8
+#endif
+#define BLOCK_CALL_MAX_ARGS         24
+#define BLOCK_CALL_MAX_INDIRECT     256
+// Larger structs are returned in memory on both targets.
+#define BLOCK_CALL_MAX_DIRECT       16
+
+struct block_call_arg {
+    uint8_t kind;
+    uint8_t where;      // BLOCK_CALL_INT, _FP or _STACK
+    uint8_t index;
+};
+
+struct block_call {
+    uint8_t count;                  // arguments after the block itself
+    uint8_t result;
+    uint16_t resultSize;
+    struct block_call_arg args[BLOCK_CALL_MAX_ARGS];
+};
+
+static const struct block_call _Block_no_call = { 0, 0, 0, {} };
+
+struct block_call_indirect {
+    char bytes[BLOCK_CALL_MAX_INDIRECT];
+};
+
+#if defined(__x86_64__)
+#define BLOCK_CALL_INT_PARAMS \
+    uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t
+#define BLOCK_CALL_INT_VALUES(i) i[0], i[1], i[2], i[3], i[4], i[5]
+#define BLOCK_CALL_INDIRECT_INT_PARAMS \
+    uintptr_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t
+#define BLOCK_CALL_INDIRECT_INT_VALUES(i) i[0], i[1], i[2], i[3], i[4]
+#else
+#define BLOCK_CALL_INT_PARAMS \
+    uintptr_t, uintptr_t, uintptr_t, uintptr_t, \
+    uintptr_t, uintptr_t, uintptr_t, uintptr_t
+#define BLOCK_CALL_INT_VALUES(i) i[0], i[1], i[2], i[3], i[4], i[5], i[6], i[7]
+#define BLOCK_CALL_INDIRECT_INT_PARAMS BLOCK_CALL_INT_PARAMS
+#define BLOCK_CALL_INDIRECT_INT_VALUES(i) BLOCK_CALL_INT_VALUES(i)
+#endif
+#define BLOCK_CALL_OTHER_PARAMS \
+    double, double, double, double, double, double, double, double, \
+    uintptr_t, uintptr_t, uintptr_t, uintptr_t, \
+    uintptr_t, uintptr_t, uintptr_t, uintptr_t
+#define BLOCK_CALL_OTHER_VALUES(f, s) \
+    f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7], \
+    s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7]
+
+// Skip type qualifiers.
+static const char *_Block_type_skip_qualifiers(const char *type) {
+    while (*type && strchr("rnNoORVAj", *type)) type++;
+    return type;
+}
+
+// Size and alignment of the type encoded at `type`. Returns the end of the
+// encoding, or NULL for encodings that are malformed or not supported.
+static const char *_Block_type_size(const char *type, size_t *size, size_t *align)
+{
+    type = _Block_type_skip_qualifiers(type);
+    switch (*type) {
+      case 'c': case 'C': case 'B': *size = *align = 1; return type + 1;
+      case 's': case 'S':           *size = *align = 2; return type + 1;
+      case 'i': case 'I': case 'l': case 'L': case 'f':
+                                    *size = *align = 4; return type + 1;
+      case 'q': case 'Q': case 'd': *size = *align = 8; return type + 1;
+      case '*': case '#': case ':':
+        *size = *align = sizeof(void *);
+        return type + 1;
+      case '@':
+        *size = *align = sizeof(void *);
+        type++;
+        if (*type == '?') return type + 1;
+        if (*type == '"') {
+            const char *end = strchr(type + 1, '"');
+            return end ? end + 1 : NULL;
+        }
+        return type;
+      case '^': {
+        size_t ignored, ignoredAlign;
+        *size = *align = sizeof(void *);
+        if (type[1] == '?') return type + 2;
+        // Pointees may be incomplete structs; only their extent matters.
+        if (type[1] == '{' || type[1] == '(') {
+            char open = type[1], close = open == '{' ? '}' : ')';
+            int depth = 0;
+            for (const char *p = type + 1; *p; p++) {
+                if (*p == open) depth++;
+                else if (*p == close && --depth == 0) return p + 1;
             }
-            
-            // 1.5 释放byref。
-            free(byref);
+            return NULL;
         }
+        return _Block_type_size(type + 1, &ignored, &ignoredAlign);
+      }
+      case '[': {
+        char *end;
+        unsigned long count = strtoul(type + 1, &end, 10);
+        size_t elementSize, elementAlign;
+        const char *next = _Block_type_size(end, &elementSize, &elementAlign);
+        if (!next || *next != ']') return NULL;
+        *size = count * elementSize;
+        *align = elementAlign;
+        return next + 1;
+      }
+      case '{': case '(': {
+        bool isUnion = *type == '(';
+        char close = isUnion ? ')' : '}';
+        const char *p = type + 1;
+        while (*p && *p != '=' && *p != close) p++;
+        if (*p != '=') return NULL;     // members unknown
+        p++;
+        size_t total = 0, maxAlign = 1;
+        while (*p != close) {
+            if (*p == '"') {            // member name
+                p = strchr(p + 1, '"');
+                if (!p) return NULL;
+                p++;
+                continue;
+            }
+            size_t memberSize, memberAlign;
+            p = _Block_type_size(p, &memberSize, &memberAlign);
+            if (!p) return NULL;
+            if (memberAlign > maxAlign) maxAlign = memberAlign;
+            if (isUnion) {
+                if (memberSize > total) total = memberSize;
+            } else {
+                total = (total + memberAlign - 1) & ~(memberAlign - 1);
+                total += memberSize;
+            }
+        }
+        *size = (total + maxAlign - 1) & ~(maxAlign - 1);
+        *align = maxAlign;
+        return p + 1;
+      }
+      default:
+        return NULL;    // bit-fields, long double, vectors, ...
     }
 }
 
+static int _Block_call_kind(const char *type) {
+    switch (*_Block_type_skip_qualifiers(type)) {
+      case 'v': return BLOCK_CALL_VOID;
+      case 'c': return BLOCK_CALL_SINT8;
+      case 'C': case 'B': return BLOCK_CALL_UINT8;
+      case 's': return BLOCK_CALL_SINT16;
+      case 'S': return BLOCK_CALL_UINT16;
+      case 'i': case 'l': return BLOCK_CALL_SINT32;
+      case 'I': case 'L': return BLOCK_CALL_UINT32;
+      case 'q': case 'Q': case '*': case '@': case '#': case ':': case '^':
+        return BLOCK_CALL_INT64;
+      case 'f': return BLOCK_CALL_FLOAT;
+      case 'd': return BLOCK_CALL_DOUBLE;
+      case '{': return BLOCK_CALL_INDIRECT;
+      default: return -1;
+    }
+}
 
-/************************************************************
- *
- * API supporting SPI
- * _Block_copy, _Block_release, and (old) _Block_destroy
- *
- ***********************************************************/
+static const char *_Block_skip_offset(const char *p) {
+    if (*p == '-' || *p == '+') p++;
+    while (*p >= '0' && *p <= '9') p++;
+    return p;
+}
 
-#if !TARGET_OS_WIN32
-#pragma mark SPI/API
+// Compile aBlock's signature into *call. Returns false if it cannot be
+// called dynamically.
+static bool _Block_call_build(struct Block_layout *aBlock, const char *signature,
+                              struct block_call *call)
+{
+    if (!signature) return false;
+
+    size_t size, align;
+    const char *p = signature;
+    int result = _Block_call_kind(p);
+    if (result < 0) return false;
+    call->result = (uint8_t)result;
+    call->resultSize = 0;
+    if (result == BLOCK_CALL_VOID) {
+        p = _Block_type_skip_qualifiers(p) + 1;
+    } else {
+        p = _Block_type_size(p, &size, &align);
+        if (!p) return false;
+        call->resultSize = (uint16_t)size;
+    }
+    if (result == BLOCK_CALL_INDIRECT) {
+        if (size <= BLOCK_CALL_MAX_DIRECT || size > BLOCK_CALL_MAX_INDIRECT) return false;
+#if defined(__x86_64__)
+        if (! (aBlock->flags & BLOCK_USE_STRET)) return false;
 #endif
+    }
+    p = _Block_skip_offset(p);
 
-// API entry point to release a copied Block
-// API 入口点以释放复制的 Block
-void _Block_release(const void *arg) {
-    // 1. 将入参 arg 强转成 (struct Block_layout *) 类型，如果入参为 NULL 则直接返回。
+    // The block itself.
+    p = _Block_type_skip_qualifiers(p);
+    if (p[0] != '@' || p[1] != '?') return false;
+    p = _Block_skip_offset(p + 2);
+
+    unsigned intRegs = result == BLOCK_CALL_INDIRECT
+        ? BLOCK_CALL_INDIRECT_INT_REGS : BLOCK_CALL_INT_REGS;
+    unsigned ints = 1, fps = 0, stack = 0;
+    call->count = 0;
+    while (*p) {
+        int kind = _Block_call_kind(p);
+        if (kind < 0 || kind == BLOCK_CALL_VOID || kind == BLOCK_CALL_INDIRECT) return false;
+        if (call->count == BLOCK_CALL_MAX_ARGS) return false;
+        p = _Block_type_size(p, &size, &align);
+        if (!p) return false;
+        p = _Block_skip_offset(p);
+
+        struct block_call_arg *arg = &call->args[call->count++];
+        arg->kind = (uint8_t)kind;
+        bool fp = kind == BLOCK_CALL_FLOAT || kind == BLOCK_CALL_DOUBLE;
+        if (fp && fps < BLOCK_CALL_FP_REGS) {
+            arg->where = BLOCK_CALL_FP;
+            arg->index = (uint8_t)fps++;
+        } else if (!fp && ints < intRegs) {
+            arg->where = BLOCK_CALL_INT;
+            arg->index = (uint8_t)ints++;
+        } else if (stack < BLOCK_CALL_STACK_WORDS) {
+            arg->where = BLOCK_CALL_STACK;
+            arg->index = (uint8_t)stack++;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const struct block_call *_Block_call(struct Block_layout *aBlock, struct block_call *local)
+{
+    struct block_shape *shape = _Block_shape(aBlock);
+    if (!shape) {
+        return _Block_call_build(aBlock, _Block_signature(aBlock), local) ? local : NULL;
+    }
+
+    const struct block_call *call = shape->call.load(std::memory_order_acquire);
+    if (!call) {
+        struct block_call *built = NULL;
+        if (_Block_call_build(aBlock, shape->signature, local)) {
+            built = (struct block_call *)malloc(sizeof(struct block_call));
+            if (!built) return local;
+            memcpy(built, local, sizeof(struct block_call));
+        }
+        const struct block_call *expected = NULL;
+        call = built ? built : &_Block_no_call;
+        if (!shape->call.compare_exchange_strong(expected, call, std::memory_order_acq_rel)) {
+            free(built);
+            call = expected;
+        }
+    }
+    return call == &_Block_no_call ? NULL : call;
+}
+
+bool _Block_invoke_dynamic(const void *arg, void *result, void * const *args) {
     struct Block_layout *aBlock = (struct Block_layout *)arg;
-    if (!aBlock) return;
-    
-    // 2. 如果入参为全局 Block 则返回不做处理。
-    // global block 在程序结束时释放
-    if (aBlock->flags & BLOCK_IS_GLOBAL) return;
-    
-    // 3. 如果入参不为堆Block则返回不做处理。
-    if (! (aBlock->flags & BLOCK_NEEDS_FREE)) return;
-    
-    // 4. 判断aBlock的引用计数是否需要释放内存。
-    // 与 copy 同样的，latching_decr_int_should_deallocate
-    // 也做了一次循环和原子性判断保证原子性。
-    // 如果该 block 的引用计数过高(0xfffe)或者过低(0)返回 false 不做处理。如果其引用计数为 2，
-    // 则将其引用计数 -1 即 BLOCK_DEALLOCATING 标明正在释放，返回 true，
-    // 如果大于 2 则将其引用计数 -2 并返回 false。
-    if (latching_decr_int_should_deallocate(&aBlock->flags)) {
-        // 5. 如果上一步骤返回了 ture，标明了该 block 需要被释放，就进入这个 if
-        // 如果 aBlock 含有 copy_dispose 助手就执行 aBlock 中的 dispose 函数，
-        // 与 copy 中的对应不再多做解释。
-        _Block_call_dispose_helper(aBlock);
-        // 6. 默认没做其他操作
-        // _Block_destructInstance = callbacks->destructInstance;
-        _Block_destructInstance(aBlock);
-        // 7. 释放 aBlock 内存
-        free(aBlock);
+    if (!aBlock) return false;
+    struct block_call local;
+    const struct block_call *call = _Block_call(aBlock, &local);
+    if (!call) return false;
+
+    uintptr_t ints[BLOCK_CALL_INT_REGS] = { (uintptr_t)aBlock };
+    double fps[BLOCK_CALL_FP_REGS] = { 0 };
+    uintptr_t stack[8] = { 0 };
+    for (unsigned i = 0; i < call->count; i++) {
+        const struct block_call_arg *a = &call->args[i];
+        const void *value = args[i];
+        uint64_t word;
+        switch (a->kind) {
+          case BLOCK_CALL_SINT8:  word = (uint64_t)(int64_t)*(const int8_t *)value; break;
+          case BLOCK_CALL_UINT8:  word = *(const uint8_t *)value; break;
+          case BLOCK_CALL_SINT16: word = (uint64_t)(int64_t)*(const int16_t *)value; break;
+          case BLOCK_CALL_UINT16: word = *(const uint16_t *)value; break;
+          case BLOCK_CALL_SINT32: word = (uint64_t)(int64_t)*(const int32_t *)value; break;
+          case BLOCK_CALL_UINT32: word = *(const uint32_t *)value; break;
+          case BLOCK_CALL_FLOAT:  word = *(const uint32_t *)value; break;
+          default:                memcpy(&word, value, 8); break;
+        }
+        if (a->where == BLOCK_CALL_INT) ints[a->index] = (uintptr_t)word;
+        else if (a->where == BLOCK_CALL_FP) memcpy(&fps[a->index], &word, 8);
+        else stack[a->index] = (uintptr_t)word;
+    }
+
+    void *invoke = (void *)aBlock->invoke;
+    switch (call->result) {
+      case BLOCK_CALL_VOID:
+        ((void (*)(BLOCK_CALL_INT_PARAMS, BLOCK_CALL_OTHER_PARAMS))invoke)
+            (BLOCK_CALL_INT_VALUES(ints), BLOCK_CALL_OTHER_VALUES(fps, stack));
+        break;
+      case BLOCK_CALL_FLOAT: {
+        float value = ((float (*)(BLOCK_CALL_INT_PARAMS, BLOCK_CALL_OTHER_PARAMS))invoke)
+            (BLOCK_CALL_INT_VALUES(ints), BLOCK_CALL_OTHER_VALUES(fps, stack));
+        memcpy(result, &value, sizeof(value));
+        break;
+      }
+      case BLOCK_CALL_DOUBLE: {
+        double value = ((double (*)(BLOCK_CALL_INT_PARAMS, BLOCK_CALL_OTHER_PARAMS))invoke)
+            (BLOCK_CALL_INT_VALUES(ints), BLOCK_CALL_OTHER_VALUES(fps, stack));
+        memcpy(result, &value, sizeof(value));
+        break;
+      }
+      case BLOCK_CALL_INDIRECT: {
+        struct block_call_indirect value =
+            ((struct block_call_indirect (*)(BLOCK_CALL_INDIRECT_INT_PARAMS, BLOCK_CALL_OTHER_PARAMS))invoke)
+            (BLOCK_CALL_INDIRECT_INT_VALUES(ints), BLOCK_CALL_OTHER_VALUES(fps, stack));
+        memcpy(result, &value, call->resultSize);
+        break;
+      }
+      default: {
+        uint64_t value = ((uint64_t (*)(BLOCK_CALL_INT_PARAMS, BLOCK_CALL_OTHER_PARAMS))invoke)
+            (BLOCK_CALL_INT_VALUES(ints), BLOCK_CALL_OTHER_VALUES(fps, stack));
+        memcpy(result, &value, call->resultSize);    // little-endian
+        break;
+      }
+    }
+    return true;
+}
+
+#else
+
+bool _Block_invoke_dynamic(const void *aBlock __unused, void *result __unused,
+                           void * const *args __unused) {
+    return false;
+}
+
+#endif
+
+/***************************************************************************
+Chunked application
+***************************************************************************/
+
+#define BLOCK_APPLY_DEFAULT_CHUNK 1024
+
+typedef void (*block_chunk_invoke_t)(void *, size_t, size_t);
+typedef void (*block_element_invoke_t)(void *, size_t);
+
+void Block_apply_chunked(size_t count, size_t chunk, const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock || count == 0) return;
+    if (chunk == 0) chunk = BLOCK_APPLY_DEFAULT_CHUNK;
+
+    block_chunk_invoke_t invoke = (block_chunk_invoke_t)(void *)aBlock->invoke;
+    size_t base = 0;
+    for (; count - base > chunk; base += chunk) {
+        invoke(aBlock, base, chunk);
+    }
+    invoke(aBlock, base, count - base);
+}
+
+// A chunked block that calls an element-wise block, as the compiler would
+// lay out ^(size_t start, size_t count) { for (...) element(start + i); }.
+struct block_chunk_adapter {
+    struct Block_layout layout;
+    struct Block_layout *element;
+};
+
+static void _Block_chunk_adapter_invoke(void *arg, size_t start, size_t count) {
+    struct Block_layout *element = ((struct block_chunk_adapter *)arg)->element;
+    block_element_invoke_t invoke = (block_element_invoke_t)(void *)element->invoke;
+    for (size_t i = start; i < start + count; i++) {
+        invoke(element, i);
+    }
+}
+
+static void _Block_chunk_adapter_copy(void *dst, const void *src) {
+    _Block_object_assign(&((struct block_chunk_adapter *)dst)->element,
+                         ((const struct block_chunk_adapter *)src)->element,
+                         BLOCK_FIELD_IS_BLOCK);
+}
+
+static void _Block_chunk_adapter_dispose(const void *arg) {
+    _Block_object_dispose(((const struct block_chunk_adapter *)arg)->element,
+                          BLOCK_FIELD_IS_BLOCK);
+}
+
+static struct {
+    struct Block_descriptor_1 d1;
+    struct Block_descriptor_2 d2;
+    struct Block_descriptor_3 d3;
+} _Block_chunk_adapter_descriptor = {
+    { 0, sizeof(struct block_chunk_adapter) },
+    { _Block_chunk_adapter_copy, _Block_chunk_adapter_dispose },
+    { "v24@?0Q8Q16", (const char *)0x100 },     // one strong capture
+};
+
+void *Block_chunked_adapter(const void *elementBlock) {
+    if (!elementBlock) return NULL;
+
+    struct block_chunk_adapter adapter;
+    adapter.layout.isa = _NSConcreteStackBlock;
+    adapter.layout.flags = BLOCK_HAS_COPY_DISPOSE | BLOCK_HAS_SIGNATURE |
+        BLOCK_HAS_EXTENDED_LAYOUT;
+    adapter.layout.reserved = 0;
+    adapter.layout.invoke = (BlockInvokeFunction)_Block_chunk_adapter_invoke;
+    adapter.layout.descriptor = &_Block_chunk_adapter_descriptor.d1;
+    adapter.element = (struct Block_layout *)elementBlock;
+    return _Block_copy(&adapter);
+}
+
+/***************************************************************************
+Parallel application
+
+A pool of one thread per CPU, less one for the caller, runs fork-join
+tasks. Every participating thread owns a Chase-Lev deque: it pushes and
+pops tasks at the bottom, and idle threads steal from the top. A thread
+waiting for a task it forked keeps running other tasks until that one is
+done, so joins never block a thread. Threads that are not pool workers
+borrow one of a few guest deques for the duration of a call; if none is
+free the call runs serially. Tasks live in the frames of the threads that
+fork them, which stay live until the join.
+
+Block_parallel_apply splits its range lazily: the thread running a range
+works through it a grain at a time, and only offers half of what remains
+when its deque is empty, that is, when an earlier offer was stolen. An
+idle pool therefore costs no splitting, and a busy one receives work in
+pieces that halve as they spread.
+***************************************************************************/
+
+#define BLOCK_POOL_MAX_WORKERS 64
+#define BLOCK_POOL_GUESTS      16
+#define BLOCK_DEQUE_SIZE       256     // power of two
+#define BLOCK_APPLY_MAX_SPLITS 64      // outstanding halves per range
+
+struct block_worker;
+
+struct block_task {
+    void (*run)(struct block_task *task, struct block_worker *self);
+    std::atomic<bool> done;
+};
+
+struct block_worker {
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    std::atomic<struct block_task *> tasks[BLOCK_DEQUE_SIZE];
+    std::atomic<bool> claimed;          // guests only
+    unsigned depth;                     // nested calls holding a guest
+    uint32_t seed;                      // victim selection
+};
+
+static struct block_worker _Block_pool_records[BLOCK_POOL_GUESTS + BLOCK_POOL_MAX_WORKERS];
+static unsigned _Block_pool_workers;
+static pthread_once_t _Block_pool_once = PTHREAD_ONCE_INIT;
+
+// Outermost calls in progress. Workers sleep while there are none.
+static std::atomic<int> _Block_pool_jobs;
+static std::atomic<int> _Block_pool_sleepers;
+static pthread_mutex_t _Block_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _Block_pool_cond = PTHREAD_COND_INITIALIZER;
+
+static bool _Block_deque_push(struct block_worker *self, struct block_task *task) {
+    int64_t b = self->bottom.load(std::memory_order_relaxed);
+    int64_t t = self->top.load(std::memory_order_acquire);
+    if (b - t >= BLOCK_DEQUE_SIZE) return false;
+    self->tasks[b & (BLOCK_DEQUE_SIZE - 1)].store(task, std::memory_order_relaxed);
+    self->bottom.store(b + 1, std::memory_order_release);
+    return true;
+}
+
+static struct block_task *_Block_deque_pop(struct block_worker *self) {
+    int64_t b = self->bottom.load(std::memory_order_relaxed) - 1;
+    self->bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = self->top.load(std::memory_order_relaxed);
+    if (t > b) {
+        self->bottom.store(b + 1, std::memory_order_relaxed);
+        return NULL;
+    }
+    struct block_task *task = self->tasks[b & (BLOCK_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if (t == b) {
+        // Last task: race the thieves for it.
+        if (!self->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                               std::memory_order_relaxed)) {
+            task = NULL;
+        }
+        self->bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+static struct block_task *_Block_deque_steal(struct block_worker *victim) {
+    int64_t t = victim->top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = victim->bottom.load(std::memory_order_acquire);
+    if (t >= b) return NULL;
+    struct block_task *task = victim->tasks[t & (BLOCK_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if (!victim->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static inline bool _Block_deque_empty(struct block_worker *self) {
+    return self->bottom.load(std::memory_order_relaxed) <=
+        self->top.load(std::memory_order_relaxed);
+}
+
+static inline void _Block_task_run(struct block_task *task, struct block_worker *self) {
+    task->run(task, self);
+    // The forking frame may return as soon as it sees this.
+    task->done.store(true, std::memory_order_release);
+}
+
+// Try every other deque once, starting from a random one.
+static struct block_task *_Block_pool_steal(struct block_worker *self) {
+    unsigned count = BLOCK_POOL_GUESTS + _Block_pool_workers;
+    uint32_t x = self->seed;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    self->seed = x;
+    for (unsigned i = 0, start = x % count; i < count; i++) {
+        struct block_worker *victim = &_Block_pool_records[(start + i) % count];
+        if (victim == self) continue;
+        struct block_task *task = _Block_deque_steal(victim);
+        if (task) return task;
+    }
+    return NULL;
+}
+
+static inline void _Block_pool_pause(unsigned *spins) {
+    if (++*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm64__)
+        __asm__ __volatile__("yield");
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+// Queue task for a thief, or run it now if the deque is full or the
+// thread has none.
+static inline void _Block_task_fork(struct block_worker *self, struct block_task *task) {
+    task->done.store(false, std::memory_order_relaxed);
+    if (!self || !_Block_deque_push(self, task)) _Block_task_run(task, self);
+}
+
+// Run other tasks until the forked task is done.
+static void _Block_task_join(struct block_worker *self, struct block_task *task) {
+    unsigned spins = 0;
+    while (!task->done.load(std::memory_order_acquire)) {
+        struct block_task *next = _Block_deque_pop(self);
+        if (!next) next = _Block_pool_steal(self);
+        if (next) {
+            _Block_task_run(next, self);
+            spins = 0;
+        } else {
+            _Block_pool_pause(&spins);
+        }
+    }
+}
+
+static void *_Block_pool_worker_main(void *arg) {
+    struct block_worker *self = (struct block_worker *)arg;
+    _Block_tsd_set(BLOCK_TSD_WORKER, self);
+    unsigned spins = 0;
+    for (;;) {
+        struct block_task *task = _Block_deque_pop(self);
+        if (!task) task = _Block_pool_steal(self);
+        if (task) {
+            _Block_task_run(task, self);
+            spins = 0;
+            continue;
+        }
+        if (_Block_pool_jobs.load(std::memory_order_seq_cst) == 0) {
+            pthread_mutex_lock(&_Block_pool_mutex);
+            _Block_pool_sleepers.fetch_add(1, std::memory_order_seq_cst);
+            while (_Block_pool_jobs.load(std::memory_order_seq_cst) == 0) {
+                pthread_cond_wait(&_Block_pool_cond, &_Block_pool_mutex);
+            }
+            _Block_pool_sleepers.fetch_sub(1, std::memory_order_relaxed);
+            pthread_mutex_unlock(&_Block_pool_mutex);
+            spins = 0;
+            continue;
+        }
+        _Block_pool_pause(&spins);
+    }
+    return NULL;
+}
+
+// LIBCLOSURE_APPLY_WORKERS overrides the number of pool threads.
+static void _Block_pool_init(void) {
+    pthread_once(&_Block_storage_once, _Block_storage_init);
+
+    long count = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    const char *env = getenv("LIBCLOSURE_APPLY_WORKERS");
+    if (env && *env) count = strtol(env, NULL, 10);
+    if (count < 0) count = 0;
+    if (count > BLOCK_POOL_MAX_WORKERS) count = BLOCK_POOL_MAX_WORKERS;
+
+    for (unsigned i = 0; i < BLOCK_POOL_GUESTS + BLOCK_POOL_MAX_WORKERS; i++) {
+        _Block_pool_records[i].seed = 2654435761u * (i + 1);
+    }
+    _Block_pool_workers = (unsigned)count;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (unsigned i = 0; i < _Block_pool_workers; i++) {
+        pthread_t thread;
+        // A worker that fails to start leaves an empty deque behind, which
+        // costs thieves a look and nothing else.
+        pthread_create(&thread, &attr, _Block_pool_worker_main,
+                       &_Block_pool_records[BLOCK_POOL_GUESTS + i]);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// The calling thread's deque, or NULL if it must run serially.
+static struct block_worker *_Block_pool_enter(void) {
+    pthread_once(&_Block_pool_once, _Block_pool_init);
+    if (_Block_pool_workers == 0) return NULL;
+
+    struct block_worker *self = (struct block_worker *)_Block_tsd_get(BLOCK_TSD_WORKER);
+    if (self) {
+        if (self < &_Block_pool_records[BLOCK_POOL_GUESTS]) self->depth++;
+        return self;
+    }
+    for (unsigned i = 0; i < BLOCK_POOL_GUESTS; i++) {
+        struct block_worker *guest = &_Block_pool_records[i];
+        bool expected = false;
+        if (!guest->claimed.load(std::memory_order_relaxed) &&
+            guest->claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            guest->depth = 1;
+            _Block_tsd_set(BLOCK_TSD_WORKER, guest);
+            if (_Block_pool_jobs.fetch_add(1, std::memory_order_seq_cst) == 0 &&
+                _Block_pool_sleepers.load(std::memory_order_seq_cst) > 0) {
+                pthread_mutex_lock(&_Block_pool_mutex);
+                pthread_cond_broadcast(&_Block_pool_cond);
+                pthread_mutex_unlock(&_Block_pool_mutex);
+            }
+            return guest;
+        }
+    }
+    return NULL;
+}
+
+static void _Block_pool_leave(struct block_worker *self) {
+    if (!self || self >= &_Block_pool_records[BLOCK_POOL_GUESTS]) return;
+    if (--self->depth) return;
+    // Everything this thread forked has been joined, so its deque is empty.
+    _Block_tsd_set(BLOCK_TSD_WORKER, NULL);
+    _Block_pool_jobs.fetch_sub(1, std::memory_order_seq_cst);
+    self->claimed.store(false, std::memory_order_release);
+}
+
+struct block_apply_job {
+    struct Block_layout *block;
+    block_element_invoke_t invoke;
+    size_t grain;
+};
+
+struct block_apply_task {
+    struct block_task task;
+    struct block_apply_job *job;
+    size_t start, end;
+};
+
+static void _Block_apply_range(struct block_apply_job *job, size_t start, size_t end,
+                               struct block_worker *self);
+
+static void _Block_apply_task_run(struct block_task *task, struct block_worker *self) {
+    struct block_apply_task *range = (struct block_apply_task *)task;
+    _Block_apply_range(range->job, range->start, range->end, self);
+}
+
+static void _Block_apply_range(struct block_apply_job *job, size_t start, size_t end,
+                               struct block_worker *self) {
+    struct block_apply_task halves[BLOCK_APPLY_MAX_SPLITS];
+    unsigned splits = 0;
+    struct Block_layout *block = job->block;
+    block_element_invoke_t invoke = job->invoke;
+    size_t grain = job->grain;
+
+    while (start < end) {
+        if (end - start > grain && splits < BLOCK_APPLY_MAX_SPLITS && _Block_deque_empty(self)) {
+            struct block_apply_task *half = &halves[splits];
+            size_t middle = start + (end - start) / 2;
+            half->task.run = _Block_apply_task_run;
+            half->task.done.store(false, std::memory_order_relaxed);
+            half->job = job;
+            half->start = middle;
+            half->end = end;
+            if (_Block_deque_push(self, &half->task)) {
+                splits++;
+                end = middle;
+                continue;
+            }
+        }
+        size_t stop = end - start > grain ? start + grain : end;
+        for (size_t i = start; i < stop; i++) invoke(block, i);
+        start = stop;
+    }
+    while (splits) {
+        _Block_task_join(self, &halves[--splits].task);
+    }
+}
+
+void Block_parallel_apply(size_t iterations, const void *arg) {
+    if (!arg || iterations == 0) return;
+
+    // Every thread works from the same heap copy. Without one, run serially
+    // on the caller's block.
+    struct Block_layout *copy = (struct Block_layout *)_Block_copy(arg);
+    struct Block_layout *aBlock = copy ? copy : (struct Block_layout *)arg;
+    block_element_invoke_t invoke = (block_element_invoke_t)(void *)aBlock->invoke;
+    struct block_worker *self = copy && iterations > 1 ? _Block_pool_enter() : NULL;
+
+    if (!self) {
+        for (size_t i = 0; i < iterations; i++) invoke(aBlock, i);
+    } else {
+        struct block_apply_job job;
+        job.block = aBlock;
+        job.invoke = invoke;
+        job.grain = iterations / ((_Block_pool_workers + 1) * 16);
+        if (job.grain == 0) job.grain = 1;
+        _Block_apply_range(&job, 0, iterations, self);
+        _Block_pool_leave(self);
+    }
+    if (copy) _Block_release(copy);
+}
+
+/***************************************************************************
+Parallel sorting
+
+Block_parallel_sort is a stable merge sort on the pool above. Ranges are
+halved and the halves sorted in parallel down to leaves small enough that
+a leaf and its scratch space stay in cache; a leaf is sorted serially by
+insertion sort of short runs followed by merges. Halves are sorted into
+the opposite buffer from the one their parent merges into, so each level
+costs one pass and no copies. Large merges are split in parallel too: the
+middle element of the longer input is found in the shorter one by binary
+search, and the two sides merge independently.
+***************************************************************************/
+
+#define BLOCK_SORT_LEAF_BYTES  (32 * 1024)
+#define BLOCK_SORT_RUN         16
+
+typedef int (*block_compare_invoke_t)(void *, const void *, const void *);
+
+struct block_sort_job {
+    char *base;
+    char *scratch;
+    size_t width;
+    size_t leaf;                        // elements
+    struct Block_layout *block;
+    block_compare_invoke_t invoke;
+};
+
+static inline int _Block_sort_compare(struct block_sort_job *job, const void *a, const void *b) {
+    return job->invoke(job->block, a, b);
+}
+
+static inline void _Block_sort_copy(void *dst, const void *src, size_t width) {
+    switch (width) {
+    case 4:  memcpy(dst, src, 4); break;
+    case 8:  memcpy(dst, src, 8); break;
+    case 16: memcpy(dst, src, 16); break;
+    default: memcpy(dst, src, width); break;
+    }
+}
+
+// Stable: on ties the element from a comes first.
+static void _Block_sort_merge_serial(struct block_sort_job *job,
+                                     const char *a, size_t na,
+                                     const char *b, size_t nb, char *dst) {
+    size_t width = job->width;
+    const char *a_end = a + na * width;
+    const char *b_end = b + nb * width;
+    if (na && nb) {
+        for (;;) {
+            if (_Block_sort_compare(job, b, a) < 0) {
+                _Block_sort_copy(dst, b, width);
+                dst += width;
+                if ((b += width) == b_end) break;
+            } else {
+                _Block_sort_copy(dst, a, width);
+                dst += width;
+                if ((a += width) == a_end) break;
+            }
+        }
+    }
+    memcpy(dst, a, a_end - a);
+    memcpy(dst + (a_end - a), b, b_end - b);
+}
+
+// hold is scratch space for one element.
+static void _Block_sort_insertion(struct block_sort_job *job, char *a, size_t n, char *hold) {
+    size_t width = job->width;
+    for (size_t i = 1; i < n; i++) {
+        char *x = a + i * width;
+        if (_Block_sort_compare(job, x - width, x) <= 0) continue;
+        _Block_sort_copy(hold, x, width);
+        size_t j = i - 1;
+        while (j > 0 && _Block_sort_compare(job, a + (j - 1) * width, hold) > 0) j--;
+        memmove(a + (j + 1) * width, a + j * width, (i - j) * width);
+        _Block_sort_copy(a + j * width, hold, width);
+    }
+}
+
+// Sort n elements of a using t as scratch. Returns whichever holds the result.
+static char *_Block_sort_leaf(struct block_sort_job *job, char *a, char *t, size_t n) {
+    size_t width = job->width;
+    for (size_t run = 0; run < n; run += BLOCK_SORT_RUN) {
+        _Block_sort_insertion(job, a + run * width,
+                              n - run < BLOCK_SORT_RUN ? n - run : BLOCK_SORT_RUN, t);
+    }
+    char *src = a, *dst = t;
+    for (size_t run = BLOCK_SORT_RUN; run < n; run *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * run) {
+            size_t middle = lo + run < n ? lo + run : n;
+            size_t hi = middle + run < n ? middle + run : n;
+            _Block_sort_merge_serial(job, src + lo * width, middle - lo,
+                                     src + middle * width, hi - middle, dst + lo * width);
+        }
+        char *swap = src; src = dst; dst = swap;
+    }
+    return src;
+}
+
+// First element of a that does not compare below pivot, or above it.
+static size_t _Block_sort_lower_bound(struct block_sort_job *job, const char *a, size_t n,
+                                      const void *pivot, bool upper) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t middle = lo + (hi - lo) / 2;
+        int order = _Block_sort_compare(job, a + middle * job->width, pivot);
+        if (order < 0 || (upper && order == 0)) lo = middle + 1;
+        else hi = middle;
+    }
+    return lo;
+}
+
+struct block_merge_task {
+    struct block_task task;
+    struct block_sort_job *job;
+    const char *a, *b;
+    size_t na, nb;
+    char *dst;
+};
+
+static void _Block_sort_merge(struct block_sort_job *job, const char *a, size_t na,
+                              const char *b, size_t nb, char *dst, struct block_worker *self);
+
+static void _Block_merge_task_run(struct block_task *task, struct block_worker *self) {
+    struct block_merge_task *merge = (struct block_merge_task *)task;
+    _Block_sort_merge(merge->job, merge->a, merge->na, merge->b, merge->nb, merge->dst, self);
+}
+
+static void _Block_sort_merge(struct block_sort_job *job, const char *a, size_t na,
+                              const char *b, size_t nb, char *dst, struct block_worker *self) {
+    if (!self || na + nb <= job->leaf) {
+        _Block_sort_merge_serial(job, a, na, b, nb, dst);
+        return;
+    }
+    // Elements equal to the pivot stay on a's side of b's, as when merging
+    // serially.
+    size_t width = job->width;
+    size_t ma, mb;
+    if (na >= nb) {
+        ma = na / 2;
+        mb = _Block_sort_lower_bound(job, b, nb, a + ma * width, false);
+    } else {
+        mb = nb / 2;
+        ma = _Block_sort_lower_bound(job, a, na, b + mb * width, true);
+    }
+    struct block_merge_task right;
+    right.task.run = _Block_merge_task_run;
+    right.job = job;
+    right.a = a + ma * width;
+    right.na = na - ma;
+    right.b = b + mb * width;
+    right.nb = nb - mb;
+    right.dst = dst + (ma + mb) * width;
+    _Block_task_fork(self, &right.task);
+    _Block_sort_merge(job, a, ma, b, mb, dst, self);
+    _Block_task_join(self, &right.task);
+}
+
+struct block_sort_task {
+    struct block_task task;
+    struct block_sort_job *job;
+    size_t first, count;
+    bool into_scratch;
+};
+
+static void _Block_sort_range(struct block_sort_job *job, size_t first, size_t count,
+                              bool into_scratch, struct block_worker *self);
+
+static void _Block_sort_task_run(struct block_task *task, struct block_worker *self) {
+    struct block_sort_task *sort = (struct block_sort_task *)task;
+    _Block_sort_range(sort->job, sort->first, sort->count, sort->into_scratch, self);
+}
+
+// Sort count elements from index first, leaving the result in the scratch
+// buffer if into_scratch, else in place.
+static void _Block_sort_range(struct block_sort_job *job, size_t first, size_t count,
+                              bool into_scratch, struct block_worker *self) {
+    size_t width = job->width;
+    char *a = job->base + first * width;
+    char *t = job->scratch + first * width;
+    if (count <= job->leaf) {
+        char *result = _Block_sort_leaf(job, a, t, count);
+        char *wanted = into_scratch ? t : a;
+        if (result != wanted) memcpy(wanted, result, count * width);
+        return;
+    }
+
+    size_t half = count / 2;
+    struct block_sort_task right;
+    right.task.run = _Block_sort_task_run;
+    right.job = job;
+    right.first = first + half;
+    right.count = count - half;
+    right.into_scratch = !into_scratch;
+    _Block_task_fork(self, &right.task);
+    _Block_sort_range(job, first, half, !into_scratch, self);
+    _Block_task_join(self, &right.task);
+
+    const char *src = into_scratch ? a : t;
+    _Block_sort_merge(job, src, half, src + half * width, count - half,
+                      into_scratch ? t : a, self);
+}
+
+int Block_parallel_sort(void *base, size_t count, size_t width, const void *comparator) {
+    if (!comparator || width == 0 || (count && width > SIZE_MAX / count)) {
+        errno = EINVAL;
+        return -1;
     }
+    if (count < 2) return 0;
+
+    char *scratch = (char *)malloc(count * width);
+    if (!scratch) return -1;
+
+    struct block_sort_job job;
+    job.base = (char *)base;
+    job.scratch = scratch;
+    job.width = width;
+    job.leaf = BLOCK_SORT_LEAF_BYTES / width;
+    if (job.leaf < BLOCK_SORT_RUN) job.leaf = BLOCK_SORT_RUN;
+    // Every thread compares through the same heap copy. Without one, sort
+    // serially with the caller's block.
+    struct Block_layout *copy = (struct Block_layout *)_Block_copy(comparator);
+    job.block = copy ? copy : (struct Block_layout *)comparator;
+    job.invoke = (block_compare_invoke_t)(void *)job.block->invoke;
+
+    struct block_worker *self = copy && count > job.leaf ? _Block_pool_enter() : NULL;
+    _Block_sort_range(&job, 0, count, false, self);
+    _Block_pool_leave(self);
+
+    if (copy) _Block_release(copy);
+    free(scratch);
+    return 0;
 }
 
 // 尝试持有
@@ -470,6 +4120,15 @@ void _Block_release(const void *arg) {
 // 3. 其他情况的话，引用增加 2
 bool _Block_tryRetain(const void *arg) {
     struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (aBlock->flags & BLOCK_PINNED) {
+        return true;
+    }
+    if (aBlock->reserved && _Block_shard_add(aBlock, 1)) {
+        return true;
+    }
+    if (aBlock->flags & BLOCK_BIASED) {
+        return _Block_bias_try_retain(aBlock);
+    }
     return latching_incr_int_not_deallocating(&aBlock->flags);
 }
 
@@ -490,6 +4149,15 @@ size_t Block_size(void *aBlock) {
     return ((struct Block_layout *)aBlock)->descriptor->size;
 }
 
+bool _Block_statistics(const void *aBlock, Block_statistics *stats) {
+    struct block_shape *shape = _Block_shape((struct Block_layout *)aBlock);
+    if (!shape) return false;
+
+    stats->copies = shape->copies.load(std::memory_order_relaxed);
+    stats->disposes = shape->disposes.load(std::memory_order_relaxed);
+    return true;
+}
+
 bool _Block_use_stret(void *aBlock) {
     struct Block_layout *layout = (struct Block_layout *)aBlock;
 
@@ -505,6 +4173,9 @@ bool _Block_has_signature(void *aBlock) {
 const char * _Block_signature(void *aBlock)
 {
     struct Block_layout *layout = (struct Block_layout *)aBlock;
+    struct block_shape *shape = _Block_shape(layout);
+    if (shape) return shape->signature;
+
     struct Block_descriptor_3 *desc3 = _Block_descriptor_3(layout);
     if (!desc3) return NULL;
 
@@ -517,6 +4188,9 @@ const char * _Block_layout(void *aBlock)
     struct Block_layout *layout = (struct Block_layout *)aBlock;
     if (layout->flags & BLOCK_HAS_EXTENDED_LAYOUT) return NULL;
 
+    struct block_shape *shape = _Block_shape(layout);
+    if (shape) return shape->layout;
+
     struct Block_descriptor_3 *desc3 = _Block_descriptor_3(layout);
     if (!desc3) return NULL;
 
@@ -528,14 +4202,20 @@ const char * _Block_extended_layout(void *aBlock)
     // Don't return old GC layout to callers expecting extended layout
     struct Block_layout *layout = (struct Block_layout *)aBlock;
     if (! (layout->flags & BLOCK_HAS_EXTENDED_LAYOUT)) return NULL;
+    if (! (layout->flags & BLOCK_HAS_SIGNATURE)) return NULL;
 
-    struct Block_descriptor_3 *desc3 = _Block_descriptor_3(layout);
-    if (!desc3) return NULL;
+    const char *extended;
+    struct block_shape *shape = _Block_shape(layout);
+    if (shape) {
+        extended = shape->layout;
+    } else {
+        extended = _Block_descriptor_3(layout)->layout;
+    }
 
     // Return empty string (all non-object bytes) instead of NULL 
     // so callers can distinguish "empty layout" from "no layout".
-    if (!desc3->layout) return "";
-    else return desc3->layout;
+    if (!extended) return "";
+    else return extended;
 }
 
 #if !TARGET_OS_WIN32